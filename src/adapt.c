@@ -0,0 +1,215 @@
+/* adapt.c - sizes an executor's worker set from measured queue wait
+ *
+ * Copyright (c) 2012 Patrick MacArthur
+ *
+ * This file is part of tpool.
+ *
+ * tpool is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * tpool is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public
+ * License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with tpool.  If not, see * <http://www.gnu.org/licenses/>.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <assert.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+#include "tpool.h"
+#include "tpool-private.h"
+
+/* The interval used when tpool_set_adaptive() is given 0, in milliseconds. */
+#define ADAPT_INTERVAL 100
+
+/* Throughput must change by more than this many percent between intervals to
+ * count as a change rather than noise. */
+#define ADAPT_NOISE 10
+
+/* After this many intervals without a step while tasks are waiting, the
+ * controller tries one more worker to see whether it now helps. */
+#define ADAPT_PROBE_AFTER 4
+
+/* Returns the time of the given clock in nanoseconds. */
+uint64_t
+adapt_clock(clockid_t clock)
+{
+	struct timespec ts;
+
+	clock_gettime(clock, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* Starts the controller with a target between minthreads and maxthreads, as
+ * near as it can to one worker per processor but no lower than floor, and
+ * takes its first decision after interval milliseconds. */
+void
+adapt_init(struct adapt *adapt, unsigned minthreads, unsigned maxthreads,
+			unsigned interval, unsigned floor, unsigned ncpus)
+{
+	assert(minthreads > 0 && minthreads <= maxthreads);
+	memset(adapt, 0, sizeof(*adapt));
+	adapt->a_min = minthreads;
+	adapt->a_max = maxthreads;
+	adapt->a_interval = (uint64_t)(interval ? interval : ADAPT_INTERVAL)
+								* 1000000;
+	adapt->a_start = adapt_clock(CLOCK_MONOTONIC);
+	adapt->a_target = ncpus < minthreads ? minthreads
+			: ncpus > maxthreads ? maxthreads : ncpus;
+	if (adapt->a_target < floor) {
+		adapt->a_target = floor;
+	}
+	adapt->a_stats.target = adapt->a_target;
+}
+
+/* Records a finished task: how long it waited in the queue, and the wall
+ * clock and processor time it took to run, all in nanoseconds. */
+void
+adapt_sample(struct adapt *adapt, uint64_t wait, uint64_t run, uint64_t cpu)
+{
+	++adapt->a_completed;
+	adapt->a_wait += wait;
+	adapt->a_run += run;
+	adapt->a_cpu += cpu;
+}
+
+/* Returns nonzero if the current interval is over. */
+int
+adapt_due(const struct adapt *adapt, uint64_t now)
+{
+	/* now may be older than a_start, if it was read before another
+	 * thread made the last decision */
+	return now >= adapt->a_start + adapt->a_interval;
+}
+
+/* Ends the current interval and returns the new target.  queued tasks are
+ * still waiting, and have waited queued_wait nanoseconds between them so far.
+ * Tasks that waited longer in the queue than they took to run mean the
+ * workers are behind; the controller then climbs towards the number of
+ * workers that gives the most throughput, one step per interval, keeping a
+ * step only if it paid for itself.  Workers are only added while the tasks
+ * leave a processor unused, so CPU-bound work settles at about one worker per
+ * processor, while tasks that block keep gaining workers until throughput
+ * stops rising.  If the queue keeps up, spare workers are released.  If no
+ * task finished at all while others waited, every worker is stuck in a long
+ * task; one more is tried if a processor is free, without judging it by a
+ * throughput of 0.  The target never goes below floor, the fewest workers
+ * that let every pool run. */
+unsigned
+adapt_decide(struct adapt *adapt, uint64_t now, uint64_t queued_wait,
+			unsigned queued, unsigned threads, unsigned floor,
+			unsigned ncpus)
+{
+	struct tpool_adapt_stats *stats = &adapt->a_stats;
+	uint64_t elapsed, throughput, last, waited;
+	unsigned lo, hi;
+	int backlog, idle, headroom, better, worse, stalled;
+	int step, reason;
+
+	elapsed = now - adapt->a_start;
+	if (elapsed < 1000) {
+		elapsed = 1000;
+	}
+	throughput = adapt->a_completed * 1000000 / (elapsed / 1000);
+	last = adapt->a_throughput;
+
+	waited = adapt->a_wait + queued_wait;
+	stalled = adapt->a_completed == 0;
+	backlog = waited > adapt->a_run;
+	idle = !stalled && adapt->a_run + elapsed < adapt->a_target * elapsed;
+	headroom = 2 * adapt->a_cpu < (2 * (uint64_t)ncpus - 1) * elapsed;
+	better = throughput * 100 > last * (100 + ADAPT_NOISE);
+	worse = throughput * (100 + ADAPT_NOISE) < last * 100;
+
+	step = 0;
+	reason = TPOOL_ADAPT_HOLD;
+	if (stalled) {
+		if (backlog && headroom) {
+			step = 1;
+			reason = TPOOL_ADAPT_PROBE;
+		}
+	} else if (!backlog) {
+		if (idle) {
+			step = -1;
+			reason = TPOOL_ADAPT_IDLE;
+		}
+	} else if (adapt->a_step == 0) {
+		if (headroom && (!last
+				|| adapt->a_holds >= ADAPT_PROBE_AFTER)) {
+			step = 1;
+			reason = TPOOL_ADAPT_PROBE;
+		} else if (!headroom && adapt->a_target > ncpus) {
+			step = -1;
+			reason = TPOOL_ADAPT_PROBE;
+		}
+	} else if (worse) {
+		step = -adapt->a_step;
+		reason = TPOOL_ADAPT_REVERSE;
+	} else if (adapt->a_step > 0) {
+		if (!better) {
+			step = -1;
+			reason = TPOOL_ADAPT_UNDO;
+		} else if (headroom) {
+			step = 1;
+			reason = TPOOL_ADAPT_CLIMB;
+		}
+	} else if (!headroom) {
+		/* fewer workers did no worse and the processors are still
+		 * saturated */
+		step = -1;
+		reason = TPOOL_ADAPT_CLIMB;
+	}
+
+	lo = adapt->a_min > floor ? adapt->a_min : floor;
+	hi = adapt->a_max > lo ? adapt->a_max : lo;
+	if (adapt->a_target < lo) {
+		adapt->a_target = lo;
+	}
+	if ((step < 0 && adapt->a_target <= lo)
+			|| (step > 0 && adapt->a_target >= hi)) {
+		step = 0;
+		reason = TPOOL_ADAPT_HOLD;
+	}
+	adapt->a_target += step;
+
+	/* Only steps taken to find out whether they help are followed up in
+	 * the next interval.  A stalled interval says nothing about
+	 * throughput, so the last real figure is kept to compare with. */
+	adapt->a_step = !stalled && (reason == TPOOL_ADAPT_PROBE
+				|| reason == TPOOL_ADAPT_CLIMB) ? step : 0;
+	adapt->a_holds = step ? 0 : adapt->a_holds + 1;
+	if (!stalled) {
+		adapt->a_throughput = throughput;
+	}
+
+	stats->target = adapt->a_target;
+	stats->threads = threads;
+	stats->change = step;
+	stats->reason = reason;
+	++stats->decisions;
+	stats->throughput = throughput;
+	stats->wait_ns = (adapt->a_completed + queued)
+			? waited / (adapt->a_completed + queued) : 0;
+	stats->run_ns = stalled ? 0 : adapt->a_run / adapt->a_completed;
+	stats->busy_load = (unsigned)(adapt->a_run * 100 / elapsed);
+	stats->cpu_load = (unsigned)(adapt->a_cpu * 100 / elapsed);
+
+	adapt->a_start = now;
+	adapt->a_completed = 0;
+	adapt->a_wait = 0;
+	adapt->a_run = 0;
+	adapt->a_cpu = 0;
+	return adapt->a_target;
+}
+
+/* vim: set shiftwidth=8 tabstop=8 noexpandtab : */
@@ -0,0 +1,226 @@
+/* bench-tpool.c - measures tpool under contention between cores
+ *
+ * Several producer threads submit empty tasks to one pool while the pool's
+ * workers run them, and then a pipeline is fed from one thread.  Run it under
+ * "perf c2c record" and compare the HITM counts that "perf c2c report" shows
+ * for the pool, queue, future and channel structures.  Last, a pool with the
+ * adaptive controller on runs a CPU-bound and then an I/O-bound workload, to
+ * show the number of workers each one settles at.
+ *
+ * To see what the padding buys, "make bench-c2c" runs this program and
+ * bench-tpool-unpadded, the same benchmark linked against a copy of the
+ * library built with -DTPOOL_UNPADDED, under "perf c2c", and leaves the two
+ * reports in bench-tpool.c2c.txt and bench-tpool-unpadded.c2c.txt.  This
+ * needs more than one processor; on a single one no line is ever shared.  No
+ * HITM figures have been recorded for the padding yet, so the reduction it
+ * gives is unmeasured.
+ *
+ * Usage: bench-tpool [producers [workers [tasks]]]
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "tpool.h"
+
+#define BATCH 64
+
+TPOOL *tpool = NULL;
+unsigned long ntasks = 200000;
+
+void *
+empty_task(void *arg)
+{
+	return arg;
+}
+
+/* Submits ntasks tasks in batches, waiting for each batch's futures. */
+void *
+producer(void *arg)
+{
+	FUTURE *futures[BATCH];
+	struct tpool_task task;
+	unsigned long done;
+	unsigned i;
+	int errcode;
+
+	(void)arg;
+	task.func = &empty_task;
+	task.arg = NULL;
+	task.flags = TASK_WANT_FUTURE;
+	for (done = 0; done < ntasks; done += BATCH) {
+		for (i = 0; i < BATCH; i++) {
+			if ((errcode = tpool_submit(tpool, &task,
+							&futures[i])) != 0) {
+				fprintf(stderr, "tpool_submit: %s\n",
+							strerror(errcode));
+				exit(EXIT_FAILURE);
+			}
+		}
+		for (i = 0; i < BATCH; i++) {
+			future_get(futures[i], TPOOL_WAIT);
+			future_free(futures[i]);
+		}
+	}
+	return NULL;
+}
+
+/* Spins for about 200 microseconds of processor time. */
+void *
+cpu_task(void *arg)
+{
+	struct timespec start, now;
+
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &start);
+	do {
+		clock_gettime(CLOCK_THREAD_CPUTIME_ID, &now);
+	} while ((now.tv_sec - start.tv_sec) * 1000000000L
+				+ (now.tv_nsec - start.tv_nsec) < 200000L);
+	return arg;
+}
+
+/* Sleeps for a millisecond, as if waiting on a device. */
+void *
+io_task(void *arg)
+{
+	struct timespec ts = { 0, 1000000L };
+
+	nanosleep(&ts, NULL);
+	return arg;
+}
+
+double
+elapsed(const struct timespec *start)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - start->tv_sec)
+			+ (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+/* Runs count tasks in a pool of up to 64 workers with the adaptive controller
+ * on, and reports the throughput and where the controller ended up. */
+void
+bench_adaptive(const char *name, void *(*func)(void *), unsigned count)
+{
+	struct tpool_adapt_stats stats;
+	struct tpool_result result;
+	struct tpool_task task;
+	struct timespec start;
+	TPOOL_RESULTQ *resultq;
+	TPOOL *pool;
+	double secs;
+	unsigned i;
+
+	if (tpool_new(64, UINT32_C(0), &pool) != 0
+			|| tpool_resultq_new(UINT32_C(0), &resultq) != 0
+			|| tpool_set_adaptive(pool, 1, 64, 20) != 0) {
+		fprintf(stderr, "adaptive: setup failed\n");
+		exit(EXIT_FAILURE);
+	}
+
+	task.func = func;
+	task.arg = NULL;
+	task.flags = 0;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 0; i < count; i++) {
+		tpool_submit_resultq(pool, &task, resultq, NULL);
+	}
+	while (tpool_resultq_next(resultq, &result, -1) == 0) {
+	}
+	secs = elapsed(&start);
+
+	tpool_get_adaptive(pool, &stats);
+	printf("adaptive %s: %.0f tasks/s, %u workers after %lu decisions\n",
+			name, count / secs, stats.target,
+			(unsigned long)stats.decisions);
+	tpool_shutdown(pool, TPOOL_WAIT);
+	tpool_free(pool);
+	tpool_resultq_free(resultq);
+}
+
+int
+main(int argc, char *argv[])
+{
+	unsigned nproducers = 4;
+	unsigned nworkers = 4;
+	pthread_t *threads;
+	TPOOL_PIPELINE *pipeline;
+	struct timespec start;
+	unsigned long pushed, popped;
+	void *item;
+	double secs;
+	unsigned i;
+	int errcode;
+
+	if (argc > 1) {
+		nproducers = strtoul(argv[1], NULL, 10);
+	}
+	if (argc > 2) {
+		nworkers = strtoul(argv[2], NULL, 10);
+	}
+	if (argc > 3) {
+		ntasks = strtoul(argv[3], NULL, 10);
+	}
+	if (!nproducers || !nworkers
+		|| !(threads = calloc(nproducers, sizeof(*threads)))) {
+		fprintf(stderr, "usage: %s [producers [workers [tasks]]]\n",
+								argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	if ((errcode = tpool_new(nworkers, UINT32_C(0), &tpool)) != 0) {
+		fprintf(stderr, "tpool_new: %s\n", strerror(errcode));
+		return EXIT_FAILURE;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 0; i < nproducers; i++) {
+		pthread_create(&threads[i], NULL, &producer, NULL);
+	}
+	for (i = 0; i < nproducers; i++) {
+		pthread_join(threads[i], NULL);
+	}
+	secs = elapsed(&start);
+	printf("submit: %u producers, %u workers: %.0f tasks/s\n",
+		nproducers, nworkers, nproducers * ntasks / secs);
+
+	tpool_pipeline_new(tpool, 256, UINT32_C(0), &pipeline);
+	tpool_pipeline_add_stage(pipeline, &empty_task, 0, 0);
+	tpool_pipeline_add_stage(pipeline, &empty_task, 0, 0);
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (pushed = popped = 0; popped < ntasks; ) {
+		while (pushed < ntasks
+			&& tpool_pipeline_push(pipeline, NULL, 0) == 0) {
+			++pushed;
+		}
+		while (tpool_pipeline_pop(pipeline, &item, TPOOL_WAIT) == 0) {
+			if (++popped == pushed) {
+				break;
+			}
+		}
+	}
+	secs = elapsed(&start);
+	printf("pipeline: 2 stages, %u workers: %.0f items/s\n",
+					nworkers, ntasks / secs);
+	tpool_pipeline_close(pipeline);
+	tpool_pipeline_free(pipeline);
+
+	tpool_shutdown(tpool, TPOOL_WAIT);
+	tpool_free(tpool);
+
+	bench_adaptive("cpu", &cpu_task, 10000);
+	bench_adaptive("io", &io_task, 10000);
+
+	free(threads);
+	return EXIT_SUCCESS;
+}
+
+/* vim: set shiftwidth=8 tabstop=8 noexpandtab : */
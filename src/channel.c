@@ -0,0 +1,187 @@
+/* channel.c - bounded lock-free channels for tpool pipelines
+ *
+ * Copyright (c) 2012 Patrick MacArthur
+ *
+ * This file is part of tpool.
+ *
+ * tpool is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * tpool is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public
+ * License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with tpool.  If not, see * <http://www.gnu.org/licenses/>.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <assert.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "tpool.h"
+#include "tpool-private.h"
+
+/* Initializes a channel with room for at least capacity items.  A FIFO channel
+ * is a bounded multi-producer, multi-consumer ring in which each cell carries a
+ * sequence number telling producers and consumers whose turn it is.  An ordered
+ * channel instead stores each item in the cell selected by its tag, so that a
+ * single consumer can take items in tag order no matter what order they were
+ * added in.  Returns 0 on success or ENOMEM. */
+int
+channel_init(struct channel *channel, size_t capacity, int ordered)
+{
+	size_t size;
+	size_t i;
+
+	assert(channel != NULL && capacity > 0);
+	memset(channel, 0, sizeof(*channel));
+	for (size = 1; size < capacity; size <<= 1)
+		;
+	if ((channel->ch_cells = calloc(size, sizeof(*channel->ch_cells)))
+								== NULL) {
+		return ENOMEM;
+	}
+	channel->ch_mask = size - 1;
+	channel->ch_ordered = ordered;
+	if (!ordered) {
+		for (i = 0; i < size; i++) {
+			channel->ch_cells[i].c_seq = i;
+		}
+	}
+
+	return 0;
+}
+
+void
+channel_destroy(struct channel *channel)
+{
+	assert(channel != NULL);
+	free(channel->ch_cells);
+	channel->ch_cells = NULL;
+}
+
+/* Adds an item with the given tag to the channel.  Returns 0 on success or
+ * EAGAIN if the channel is full.  For an ordered channel, the caller must
+ * guarantee that no item whose tag maps to the same cell is still waiting to
+ * be taken. */
+int
+channel_put(struct channel *channel, uint64_t tag, void *item)
+{
+	struct channel_cell *cell;
+	size_t pos;
+	size_t seq;
+	intptr_t dif;
+
+	if (channel->ch_ordered) {
+		cell = &channel->ch_cells[tag & channel->ch_mask];
+		cell->c_tag = tag;
+		cell->c_item = item;
+		__atomic_store_n(&cell->c_seq, (size_t)tag + 1,
+							__ATOMIC_RELEASE);
+		return 0;
+	}
+
+	pos = __atomic_load_n(&channel->ch_head, __ATOMIC_RELAXED);
+	for (;;) {
+		cell = &channel->ch_cells[pos & channel->ch_mask];
+		seq = __atomic_load_n(&cell->c_seq, __ATOMIC_ACQUIRE);
+		dif = (intptr_t)seq - (intptr_t)pos;
+		if (dif == 0) {
+			if (__atomic_compare_exchange_n(&channel->ch_head,
+						&pos, pos + 1, 1,
+						__ATOMIC_RELAXED,
+						__ATOMIC_RELAXED)) {
+				break;
+			}
+		} else if (dif < 0) {
+			return EAGAIN;
+		} else {
+			pos = __atomic_load_n(&channel->ch_head,
+							__ATOMIC_RELAXED);
+		}
+	}
+
+	cell->c_tag = tag;
+	cell->c_item = item;
+	__atomic_store_n(&cell->c_seq, pos + 1, __ATOMIC_RELEASE);
+	return 0;
+}
+
+/* Takes the item at the head of a FIFO channel, placing its tag in *tagp and
+ * the item itself in *itemp.  For an ordered channel, takes the item whose tag
+ * is *tagp, if it has been added; only one thread at a time may take from an
+ * ordered channel.  Returns 0 on success or EAGAIN if there is no such item. */
+int
+channel_take(struct channel *channel, uint64_t *tagp, void **itemp)
+{
+	struct channel_cell *cell;
+	size_t pos;
+	size_t seq;
+	intptr_t dif;
+
+	if (channel->ch_ordered) {
+		cell = &channel->ch_cells[*tagp & channel->ch_mask];
+		if (__atomic_load_n(&cell->c_seq, __ATOMIC_ACQUIRE)
+						!= (size_t)*tagp + 1) {
+			return EAGAIN;
+		}
+		*itemp = cell->c_item;
+		return 0;
+	}
+
+	pos = __atomic_load_n(&channel->ch_tail, __ATOMIC_RELAXED);
+	for (;;) {
+		cell = &channel->ch_cells[pos & channel->ch_mask];
+		seq = __atomic_load_n(&cell->c_seq, __ATOMIC_ACQUIRE);
+		dif = (intptr_t)seq - (intptr_t)(pos + 1);
+		if (dif == 0) {
+			if (__atomic_compare_exchange_n(&channel->ch_tail,
+						&pos, pos + 1, 1,
+						__ATOMIC_RELAXED,
+						__ATOMIC_RELAXED)) {
+				break;
+			}
+		} else if (dif < 0) {
+			return EAGAIN;
+		} else {
+			pos = __atomic_load_n(&channel->ch_tail,
+							__ATOMIC_RELAXED);
+		}
+	}
+
+	*tagp = cell->c_tag;
+	*itemp = cell->c_item;
+	__atomic_store_n(&cell->c_seq, pos + channel->ch_mask + 1,
+							__ATOMIC_RELEASE);
+	return 0;
+}
+
+/* Returns nonzero if channel_take() would find an item.  The tag argument is
+ * only used for ordered channels. */
+int
+channel_ready(struct channel *channel, uint64_t tag)
+{
+	struct channel_cell *cell;
+	size_t pos;
+
+	if (channel->ch_ordered) {
+		cell = &channel->ch_cells[tag & channel->ch_mask];
+		return __atomic_load_n(&cell->c_seq, __ATOMIC_ACQUIRE)
+							== (size_t)tag + 1;
+	}
+
+	pos = __atomic_load_n(&channel->ch_tail, __ATOMIC_ACQUIRE);
+	cell = &channel->ch_cells[pos & channel->ch_mask];
+	return __atomic_load_n(&cell->c_seq, __ATOMIC_ACQUIRE) == pos + 1;
+}
+
+/* vim: set shiftwidth=8 tabstop=8 noexpandtab : */
@@ -65,8 +65,10 @@ future_set(FUTURE *future, void *value)
 
 	future->f_value = value;
 	future->f_ready = 1;
-	pthread_mutex_unlock(&future->f_mutex);
+	/* Signal before unlocking: once the mutex is released, the owner may
+	 * see f_ready and free the future. */
 	pthread_cond_signal(&future->f_cond);
+	pthread_mutex_unlock(&future->f_mutex);
 }
 
 /* Returns a future value.  Returns NULL if there was an error; otherwise
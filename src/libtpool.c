@@ -32,62 +32,294 @@
 #include "tpool.h"
 #include "tpool-private.h"
 
-/* A thread pool. */
-struct tpool {
-	int                     alive;
-	struct task_queue       queue;
-	pthread_mutex_t         tp_mutex;
+/* A set of worker threads shared by one or more thread pools.  Workers are
+ * started on demand, up to ex_target of them, and exit when no pool has a task
+ * they may run.  The target is ex_size unless the adaptive controller is on.
+ * All scheduling state of the executor and its pools is protected by
+ * ex_mutex. */
+struct tpool_executor {
+	unsigned                ex_size;
+	unsigned                ex_ncpus;
 
-	/* this is broadcast when the last thread exits the thread pool. */
-	pthread_cond_t          tp_cond_empty;
+	/* set while the adaptive controller is on; submitters read it
+	 * without the mutex to decide whether to stamp their tasks */
+	int                     ex_adaptive;
+
+	/* the end of the controller's interval, read the same way so that a
+	 * submitter can make the decision when no task finishes */
+	uint64_t                ex_due;
+
+	/* set if the executor was created by tpool_new() for a single pool */
+	int                     ex_private;
+
+	/* size of the scratch arena given to each new worker */
+	size_t                  scratch_size;
+
+	/* Everything below is written under ex_mutex, so it shares the
+	 * mutex's lines rather than the read-mostly fields above. */
+	pthread_mutex_t         ex_mutex TPOOL_ALIGNED;
+
+	/* this is broadcast when the last worker thread exits. */
+	pthread_cond_t          ex_cond_empty;
+
+	unsigned                ex_threads;
+	unsigned                ex_target;
 
-	/* The set of threads in the pool. */
+	/* sum of the minimum thread counts of the pools, and the number of
+	 * pools without one */
+	unsigned                ex_reserved;
+	unsigned                ex_unreserved;
+
+	/* The pools sharing the executor form a ring, which workers walk
+	 * starting at ex_cursor. */
+	struct tpool_pool       *ex_cursor;
+
+	struct adapt            ex_adapt;
+};
+
+/* A thread pool.  The fields every submitter reads come first; the
+ * scheduling state that workers update under the executor's ex_mutex and the
+ * two ends of the task queue each start on a line of their own. */
+struct tpool_pool {
+	int                     alive;
+	TPOOL_EXECUTOR          *executor;
+
+	/* Share of the executor's workers.  Tasks are charged against
+	 * deficit, which is refilled with weight tasks each round. */
+	unsigned                weight;
+	unsigned                min_threads;
 	unsigned                pool_size;
-	unsigned                n_threads;
 	uint32_t		flags;
+
+	/* The set of threads running tasks from the pool. */
+	unsigned                n_threads TPOOL_ALIGNED;
+	unsigned                n_queued;
+	unsigned                deficit;
+
+	/* the number of queued tasks that were stamped, and the sum of their
+	 * stamps, from which the controller learns how long they have been
+	 * waiting */
+	unsigned                n_stamped;
+	uint64_t                stamp_sum;
+	struct tpool_pool       *tp_next;
+	struct tpool_pool       *tp_prev;
+
+	/* this is broadcast when the pool has no running or queued tasks. */
+	pthread_cond_t          tp_cond_empty;
+
+	struct task_queue       queue;
 };
 
-/* Initializes a new thread pool at the address pointed to by tpool.  The
- * maxthreads argument specifies the maximum number of threads in this pool.
- * The flags argument specifies additional flags.  Currently no flags are
- * defined and the only acceptable value is UINT32_C(0).  Returns 0 on success;
- * on error, it returns a nonzero error number, and the contents of *tpool are
- * undefined.  This function may fail with EINVAL if an invalid value is given
- * for tpool, maxthreads, or flags. */
+static void *
+pool_worker(void *threadarg);
+
+/* The default size of a worker's scratch arena. */
+#define TPOOL_SCRATCH_SIZE (64 * 1024)
+
+/* Allocates zeroed memory aligned to TPOOL_CACHELINE, for structures laid out
+ * with TPOOL_ALIGNED.  Returns NULL and sets errno on failure.  The memory is
+ * freed with free(). */
+void *
+cache_calloc(size_t size)
+{
+	void *ptr;
+	int errcode;
+
+	if ((errcode = posix_memalign(&ptr, TPOOL_CACHELINE, size)) != 0) {
+		errno = errcode;
+		return NULL;
+	}
+	memset(ptr, 0, size);
+	return ptr;
+}
+
+/* Initializes a new executor which runs tasks for its pools in up to
+ * maxthreads worker threads, and stores it in *executorp.  If maxthreads is 0,
+ * the number of online processors is used.  The flags argument is reserved and
+ * must be UINT32_C(0).  Returns 0 on success; on error, it returns a nonzero
+ * error number.  This function may fail with EINVAL if an invalid value is
+ * given for executorp or flags. */
 TPOOL_EXPORT int
-tpool_new(unsigned maxthreads, uint32_t flags, TPOOL **tpoolp)
+tpool_executor_new(unsigned maxthreads, uint32_t flags,
+						TPOOL_EXECUTOR **executorp)
+{
+	TPOOL_EXECUTOR *executor;
+	long nprocs;
+	int errcode;
+
+	if (!executorp || flags) {
+		errcode = EINVAL;
+		goto exit;
+	}
+	nprocs = sysconf(_SC_NPROCESSORS_ONLN);
+	if (nprocs < 1) {
+		nprocs = 1;
+	}
+	if (!maxthreads) {
+		maxthreads = (unsigned)nprocs;
+	}
+
+	if ((executor = cache_calloc(sizeof(*executor))) == NULL) {
+		errcode = errno;
+		goto exit;
+	}
+	executor->ex_size = maxthreads;
+	executor->ex_ncpus = (unsigned)nprocs;
+	executor->ex_target = maxthreads;
+	executor->scratch_size = TPOOL_SCRATCH_SIZE;
+	if ((errcode = pthread_mutex_init(&executor->ex_mutex, NULL)) != 0) {
+		goto fail0;
+	}
+	if ((errcode = pthread_cond_init(&executor->ex_cond_empty, NULL))
+									!= 0) {
+		goto fail1;
+	}
+
+	errcode = 0;
+	*executorp = executor;
+	goto exit;
+fail1:
+	assert(errcode != 0);
+	pthread_mutex_destroy(&executor->ex_mutex);
+fail0:
+	assert(errcode != 0);
+	free(executor);
+exit:
+	return errcode;
+}
+
+/* Waits for the executor's worker threads to exit and frees it. */
+static void
+executor_destroy(TPOOL_EXECUTOR *executor)
+{
+	pthread_mutex_lock(&executor->ex_mutex);
+	while (executor->ex_threads > 0) {
+		pthread_cond_wait(&executor->ex_cond_empty,
+						&executor->ex_mutex);
+	}
+	pthread_mutex_unlock(&executor->ex_mutex);
+
+	pthread_mutex_destroy(&executor->ex_mutex);
+	pthread_cond_destroy(&executor->ex_cond_empty);
+	free(executor);
+}
+
+/* Destroys an executor.  Returns 0 on success, EINVAL if executor is NULL, or
+ * EBUSY if any thread pool still uses the executor. */
+TPOOL_EXPORT int
+tpool_executor_free(TPOOL_EXECUTOR *executor)
+{
+	int busy;
+
+	if (!executor) {
+		return EINVAL;
+	}
+
+	pthread_mutex_lock(&executor->ex_mutex);
+	busy = (executor->ex_cursor != NULL);
+	pthread_mutex_unlock(&executor->ex_mutex);
+	if (busy) {
+		return EBUSY;
+	}
+
+	executor_destroy(executor);
+	return 0;
+}
+
+/* Returns the fewest workers the executor may run: one for every pool's
+ * minimum, and one more if a pool has none, since executor_pick() only gives
+ * such a pool a worker that no other pool is owed.  Must be called with
+ * ex_mutex held. */
+static unsigned
+executor_floor(TPOOL_EXECUTOR *executor)
+{
+	return executor->ex_reserved + (executor->ex_unreserved ? 1 : 0);
+}
+
+/* Initializes a new thread pool whose tasks are run by the worker threads of
+ * the given executor, and stores it in *tpoolp.  Pools sharing an executor
+ * take turns by deficit round-robin: each pool may have up to weight tasks
+ * started in a round before the next pool gets a turn.  A pool with fewer than
+ * minthreads tasks running is served ahead of the others, and at most
+ * maxthreads of its tasks run at once.  A maxthreads of 0 allows the pool to
+ * use every worker.  The flags argument is reserved and must be UINT32_C(0).
+ * Returns 0 on success; on error, it returns a nonzero error number.  This
+ * function may fail with EINVAL if an invalid value is given for an argument,
+ * or with EAGAIN if the executor does not have minthreads workers left to
+ * promise.  A pool without a minimum only gets workers no other pool is owed,
+ * so if there is one, a worker must be left over after every minimum. */
+TPOOL_EXPORT int
+tpool_new_shared(TPOOL_EXECUTOR *executor, unsigned weight,
+			unsigned minthreads, unsigned maxthreads,
+			uint32_t flags, TPOOL **tpoolp)
 {
 	TPOOL *tpool;
 	int errcode;
 
-	if (!tpoolp || !maxthreads || flags) {
+	if (!executor || !tpoolp || !weight || flags) {
+		errcode = EINVAL;
+		goto exit;
+	}
+	if (!maxthreads || maxthreads > executor->ex_size) {
+		maxthreads = executor->ex_size;
+	}
+	if (minthreads > maxthreads) {
 		errcode = EINVAL;
 		goto exit;
 	}
 
-	if ((tpool = calloc(1, sizeof(*tpool))) == NULL) {
+	if ((tpool = cache_calloc(sizeof(*tpool))) == NULL) {
 		errcode = errno;
 		goto exit;
 	}
+	tpool->executor = executor;
+	tpool->weight = weight;
+	tpool->min_threads = minthreads;
 	tpool->pool_size = maxthreads;
 	tpool->alive = 1;
 	tpool->flags = flags;
 	if ((errcode = task_queue_init(&tpool->queue)) != 0) {
 		goto fail0;
 	}
-	if ((errcode = pthread_mutex_init(&tpool->tp_mutex, NULL)) != 0) {
+	if ((errcode = pthread_cond_init(&tpool->tp_cond_empty, NULL)) != 0) {
 		goto fail1;
 	}
-	if ((errcode = pthread_cond_init(&tpool->tp_cond_empty, NULL)) != 0) {
+
+	pthread_mutex_lock(&executor->ex_mutex);
+	if (executor->ex_reserved + minthreads
+			+ (executor->ex_unreserved || !minthreads)
+						> executor->ex_size) {
+		pthread_mutex_unlock(&executor->ex_mutex);
+		errcode = EAGAIN;
 		goto fail2;
 	}
+	executor->ex_reserved += minthreads;
+	if (!minthreads) {
+		++executor->ex_unreserved;
+	}
+	if (executor->ex_adaptive
+			&& executor->ex_target < executor_floor(executor)) {
+		executor->ex_adapt.a_target = executor_floor(executor);
+		__atomic_store_n(&executor->ex_target,
+				executor->ex_adapt.a_target, __ATOMIC_RELAXED);
+	}
+	if (executor->ex_cursor) {
+		tpool->tp_next = executor->ex_cursor;
+		tpool->tp_prev = executor->ex_cursor->tp_prev;
+		tpool->tp_prev->tp_next = tpool;
+		tpool->tp_next->tp_prev = tpool;
+	} else {
+		tpool->tp_next = tpool->tp_prev = tpool;
+		executor->ex_cursor = tpool;
+	}
+	pthread_mutex_unlock(&executor->ex_mutex);
 
 	errcode = 0;
 	*tpoolp = tpool;
 	goto exit;
 fail2:
 	assert(errcode != 0);
-	pthread_mutex_destroy(&tpool->tp_mutex);
+	pthread_cond_destroy(&tpool->tp_cond_empty);
 fail1:
 	assert(errcode != 0);
 	task_queue_destroy(&tpool->queue);
@@ -98,6 +330,44 @@ exit:
 	return errcode;
 }
 
+/* Returns the most tasks the pool may run at once: its maxthreads, after
+ * tpool_new_shared() limited it to the executor's size, or 0 if tpool is
+ * NULL. */
+TPOOL_EXPORT unsigned
+tpool_get_size(TPOOL *tpool)
+{
+	return tpool ? tpool->pool_size : 0;
+}
+
+/* Initializes a new thread pool at the address pointed to by tpool.  The
+ * maxthreads argument specifies the maximum number of threads in this pool.
+ * The flags argument specifies additional flags.  Currently no flags are
+ * defined and the only acceptable value is UINT32_C(0).  Returns 0 on success;
+ * on error, it returns a nonzero error number, and the contents of *tpool are
+ * undefined.  This function may fail with EINVAL if an invalid value is given
+ * for tpool, maxthreads, or flags.  The pool has an executor of its own, which
+ * is freed along with it. */
+TPOOL_EXPORT int
+tpool_new(unsigned maxthreads, uint32_t flags, TPOOL **tpoolp)
+{
+	TPOOL_EXECUTOR *executor;
+	int errcode;
+
+	if (!tpoolp || !maxthreads || flags) {
+		return EINVAL;
+	}
+
+	if ((errcode = tpool_executor_new(maxthreads, flags, &executor)) != 0) {
+		return errcode;
+	}
+	executor->ex_private = 1;
+	if ((errcode = tpool_new_shared(executor, 1, 0, maxthreads, flags,
+							tpoolp)) != 0) {
+		executor_destroy(executor);
+	}
+	return errcode;
+}
+
 /* Destroys the thread pool at the address pointed to by *tpool.  The contents
  * of *tpool are undefined after calling this function.  Returns 0 on success;
  * on error, it returns a nonzero error number.  If EINVAL or EBUSY are
@@ -108,86 +378,372 @@ exit:
 TPOOL_EXPORT int
 tpool_free(TPOOL *tpool)
 {
-	int errcode;
+	TPOOL_EXECUTOR *executor;
 	int retval;
 
 	if (!tpool) {
 		retval = EINVAL;
 		goto exit;
 	}
+	executor = tpool->executor;
 
-	pthread_mutex_lock(&tpool->tp_mutex);
-	if (tpool->alive || tpool->n_threads || tpool->queue.q_head) {
+	pthread_mutex_lock(&executor->ex_mutex);
+	if (tpool->alive || tpool->n_threads
+			|| __atomic_load_n(&tpool->n_queued, __ATOMIC_RELAXED)) {
 		retval = EBUSY;
 		goto fail1;
 	}
-	if ((errcode = task_queue_destroy(&tpool->queue)) != 0) {
-		retval = errcode;
-		assert(errcode != EBUSY);
+
+	/* Take the pool out of the executor's ring. */
+	executor->ex_reserved -= tpool->min_threads;
+	if (!tpool->min_threads) {
+		--executor->ex_unreserved;
 	}
+	if (tpool->tp_next == tpool) {
+		executor->ex_cursor = NULL;
+	} else {
+		tpool->tp_prev->tp_next = tpool->tp_next;
+		tpool->tp_next->tp_prev = tpool->tp_prev;
+		if (executor->ex_cursor == tpool) {
+			executor->ex_cursor = tpool->tp_next;
+		}
+	}
+	pthread_mutex_unlock(&executor->ex_mutex);
 
-	pthread_mutex_unlock(&tpool->tp_mutex);
-	pthread_mutex_destroy(&tpool->tp_mutex);
+	if ((retval = task_queue_destroy(&tpool->queue)) != 0) {
+		assert(retval != EBUSY);
+	}
 	pthread_cond_destroy(&tpool->tp_cond_empty);
+	free(tpool);
 
-	retval = 0;
+	if (executor->ex_private) {
+		executor_destroy(executor);
+	}
 	goto exit;
 
 fail1:
-	pthread_mutex_unlock(&tpool->tp_mutex);
+	pthread_mutex_unlock(&executor->ex_mutex);
 
 exit:
 	return retval;
 }
 
 
+/* Sets the size of the scratch arena that each worker thread in the pool
+ * uses for tpool_scratch_alloc().  The new size applies to worker threads
+ * started after this call, and to every pool sharing the same executor.  A
+ * size of 0 sends every scratch allocation to the heap.  Returns 0 on success
+ * or EINVAL if tpool is NULL. */
+TPOOL_EXPORT int
+tpool_set_scratch_size(TPOOL *tpool, size_t size)
+{
+	if (!tpool) {
+		return EINVAL;
+	}
+
+	pthread_mutex_lock(&tpool->executor->ex_mutex);
+	tpool->executor->scratch_size = size;
+	pthread_mutex_unlock(&tpool->executor->ex_mutex);
+	return 0;
+}
+
+/* Turns on the adaptive controller of the pool's executor, which then runs
+ * between minthreads and maxthreads workers instead of always up to its full
+ * size.  Every interval milliseconds, or 100 if interval is 0, the controller
+ * looks at how long tasks waited in the queue, how long they ran and how much
+ * processor time they used, and adds or removes at most one worker; see
+ * tpool_get_adaptive() for its decisions.  The controller applies to every
+ * pool sharing the executor, and never goes below the sum of their minimum
+ * thread counts, plus one if a pool has no minimum.  A minthreads of 0 is
+ * taken as 1, and a maxthreads greater than the executor's size as that
+ * size.  A maxthreads of 0 turns the
+ * controller off.  Calling this again restarts the controller.  Returns 0 on
+ * success, or EINVAL if tpool is NULL or minthreads is greater than
+ * maxthreads. */
+TPOOL_EXPORT int
+tpool_set_adaptive(TPOOL *tpool, unsigned minthreads, unsigned maxthreads,
+							unsigned interval)
+{
+	TPOOL_EXECUTOR *executor;
+
+	if (!tpool) {
+		return EINVAL;
+	}
+	executor = tpool->executor;
+	if (maxthreads > executor->ex_size) {
+		maxthreads = executor->ex_size;
+	}
+	if (!minthreads) {
+		minthreads = 1;
+	}
+	if (maxthreads && minthreads > maxthreads) {
+		return EINVAL;
+	}
+
+	pthread_mutex_lock(&executor->ex_mutex);
+	if (maxthreads) {
+		adapt_init(&executor->ex_adapt, minthreads, maxthreads,
+				interval, executor_floor(executor),
+				executor->ex_ncpus);
+		__atomic_store_n(&executor->ex_due,
+				executor->ex_adapt.a_start
+				+ executor->ex_adapt.a_interval,
+				__ATOMIC_RELAXED);
+		__atomic_store_n(&executor->ex_target,
+				executor->ex_adapt.a_target, __ATOMIC_RELAXED);
+	} else {
+		__atomic_store_n(&executor->ex_target, executor->ex_size,
+							__ATOMIC_RELAXED);
+	}
+	__atomic_store_n(&executor->ex_adaptive, maxthreads != 0,
+							__ATOMIC_RELAXED);
+	pthread_mutex_unlock(&executor->ex_mutex);
+	return 0;
+}
+
+/* Stores the adaptive controller's last decision for the pool's executor in
+ * *stats.  Before the first decision, only target is set.  Returns 0 on
+ * success, EINVAL if an argument is NULL, or ENOENT if the controller is
+ * off. */
+TPOOL_EXPORT int
+tpool_get_adaptive(TPOOL *tpool, struct tpool_adapt_stats *stats)
+{
+	TPOOL_EXECUTOR *executor;
+	int errcode;
+
+	if (!tpool || !stats) {
+		return EINVAL;
+	}
+	executor = tpool->executor;
+
+	pthread_mutex_lock(&executor->ex_mutex);
+	if (executor->ex_adaptive) {
+		*stats = executor->ex_adapt.a_stats;
+		errcode = 0;
+	} else {
+		errcode = ENOENT;
+	}
+	pthread_mutex_unlock(&executor->ex_mutex);
+	return errcode;
+}
+
+/* Chooses the pool whose task a worker should run next, or returns NULL if no
+ * pool has a task that may be run now.  Pools below their minimum thread count
+ * are served first.  The rest are served by deficit round-robin: the pool at
+ * the cursor keeps its turn until it has started weight tasks, and a pool with
+ * nothing to run forfeits its turn.  Workers that pools below their minimum
+ * may still need are held back from the round-robin, even while those pools
+ * have nothing queued, so that a busy pool cannot take them.  Must be called
+ * with ex_mutex held. */
+static TPOOL *
+executor_pick(TPOOL_EXECUTOR *executor)
+{
+	TPOOL *tpool;
+	TPOOL *start;
+	unsigned busy = 0;
+	unsigned owed = 0;
+	int spare;
+
+	if ((start = executor->ex_cursor) == NULL) {
+		return NULL;
+	}
+
+	tpool = start;
+	do {
+		if (__atomic_load_n(&tpool->n_queued, __ATOMIC_SEQ_CST)
+				&& tpool->n_threads < tpool->min_threads) {
+			return tpool;
+		}
+		busy += tpool->n_threads;
+		if (tpool->n_threads < tpool->min_threads) {
+			owed += tpool->min_threads - tpool->n_threads;
+		}
+		tpool = tpool->tp_next;
+	} while (tpool != start);
+
+	/* The calling worker is idle, so it is one of the spare workers.  The
+	 * pools left are all at or above their minimum, so one may only have
+	 * it if that still leaves enough for what the others are owed. */
+	spare = (int)executor->ex_target - (int)busy;
+
+	do {
+		tpool = executor->ex_cursor;
+		if (__atomic_load_n(&tpool->n_queued, __ATOMIC_SEQ_CST)
+				&& tpool->n_threads < tpool->pool_size
+				&& spare - 1 >= (int)owed) {
+			if (tpool->deficit == 0) {
+				tpool->deficit = tpool->weight;
+			}
+			if (--tpool->deficit == 0) {
+				executor->ex_cursor = tpool->tp_next;
+			}
+			return tpool;
+		}
+		tpool->deficit = 0;
+		executor->ex_cursor = tpool->tp_next;
+	} while (executor->ex_cursor != start);
+
+	return NULL;
+}
+
+/* Takes a task that is no longer queued out of the pool's stamp totals. */
+static void
+pool_unstamp(TPOOL *tpool, uint64_t stamp)
+{
+	__atomic_sub_fetch(&tpool->n_stamped, 1, __ATOMIC_RELAXED);
+	__atomic_sub_fetch(&tpool->stamp_sum, stamp, __ATOMIC_RELAXED);
+}
+
+/* Applies the adaptive controller's decision if its interval is over.  The
+ * tasks still queued count towards the wait, so that a backlog shows even
+ * while no task finishes.  The target only goes up while tasks are waiting,
+ * so another worker is started for them then; if it goes down, workers
+ * notice in pool_worker() and exit.  Must be called with ex_mutex held. */
+static void
+executor_decide(TPOOL_EXECUTOR *executor, uint64_t now)
+{
+	TPOOL *tpool;
+	uint64_t sum = 0;
+	uint64_t waited;
+	unsigned queued = 0;
+	pthread_t threadid;
+
+	if (!executor->ex_adaptive || !adapt_due(&executor->ex_adapt, now)) {
+		return;
+	}
+
+	if ((tpool = executor->ex_cursor) != NULL) {
+		do {
+			queued += __atomic_load_n(&tpool->n_stamped,
+							__ATOMIC_RELAXED);
+			sum += __atomic_load_n(&tpool->stamp_sum,
+							__ATOMIC_RELAXED);
+			tpool = tpool->tp_next;
+		} while (tpool != executor->ex_cursor);
+	}
+	/* A task stamped after now would count as having waited less than
+	 * nothing; the total is only an estimate, so clamp it. */
+	waited = (uint64_t)queued * now > sum ? (uint64_t)queued * now - sum : 0;
+
+	__atomic_store_n(&executor->ex_target,
+			adapt_decide(&executor->ex_adapt, now, waited, queued,
+				executor->ex_threads, executor_floor(executor),
+				executor->ex_ncpus), __ATOMIC_RELAXED);
+	__atomic_store_n(&executor->ex_due, executor->ex_adapt.a_start
+			+ executor->ex_adapt.a_interval, __ATOMIC_RELAXED);
+	if (executor->ex_adapt.a_stats.change > 0
+			&& executor->ex_threads < executor->ex_target
+			&& pthread_create(&threadid, NULL, &pool_worker,
+							executor) == 0) {
+		__atomic_add_fetch(&executor->ex_threads, 1,
+							__ATOMIC_RELAXED);
+	}
+}
+
+/* Feeds a finished task to the adaptive controller, and applies its decision
+ * if that ends the interval.  Must be called with ex_mutex held. */
+static void
+executor_adapt(TPOOL_EXECUTOR *executor, uint64_t wait, uint64_t run,
+								uint64_t cpu)
+{
+	adapt_sample(&executor->ex_adapt, wait, run, cpu);
+	executor_decide(executor, adapt_clock(CLOCK_MONOTONIC));
+}
+
 /* This is the main work function of a pool worker thread.  This thread will
- * loop as long as there are tasks in the queue, pulling tasks off the queue and
- * executing them. */
+ * loop as long as any pool sharing its executor has a task it may run,
+ * pulling tasks off that pool's queue and executing them.  It also exits if
+ * the executor is running more workers than its target. */
 static void *
 pool_worker(void *threadarg)
 {
-	struct tpool_task *task;
+	struct tpool_task task;
 	void *result;
 	int errcode;
+	TPOOL_EXECUTOR *executor;
 	TPOOL *tpool;
 	FUTURE *future;
+	struct result_node *rnode;
+	union task_payload payload;
+	struct scratch scratch;
+	uint64_t stamp, start, run, cpu;
+	int timed;
 	pthread_detach(pthread_self());
-	tpool = (TPOOL *)threadarg;
+	executor = (TPOOL_EXECUTOR *)threadarg;
+
+	pthread_mutex_lock(&executor->ex_mutex);
+	scratch_init(&scratch, executor->scratch_size);
+	scratch_bind(&scratch);
 
 	for (;;) {
-		if ((errcode = task_queue_remove(&tpool->queue, &task,
-								&future)) == 0) {
-			if (task == NULL) {
-				goto exit;
+		tpool = NULL;
+		if (executor->ex_threads <= executor->ex_target) {
+			tpool = executor_pick(executor);
+		}
+		if (tpool == NULL) {
+			/* A submitter that read ex_threads before this
+			 * decrement did not start a worker, and counted its
+			 * task before reading, so one more look finds it. */
+			__atomic_sub_fetch(&executor->ex_threads, 1,
+							__ATOMIC_SEQ_CST);
+			if (executor->ex_threads >= executor->ex_target
+				|| (tpool = executor_pick(executor)) == NULL) {
+				break;
 			}
+			__atomic_add_fetch(&executor->ex_threads, 1,
+							__ATOMIC_RELAXED);
+		}
+		__atomic_sub_fetch(&tpool->n_queued, 1, __ATOMIC_RELAXED);
+		__atomic_add_fetch(&tpool->n_threads, 1, __ATOMIC_RELAXED);
+		timed = executor->ex_adaptive;
+		pthread_mutex_unlock(&executor->ex_mutex);
 
-			result = task->func(task->arg);
-			if (task->flags & TASK_WANT_FUTURE) {
+		/* n_queued counted this task only after it was added, so the
+		 * queue cannot be empty here. */
+		if ((errcode = task_queue_remove(&tpool->queue, &task,
+				&payload, &future, &rnode, &stamp)) == 0) {
+			if (stamp) {
+				pool_unstamp(tpool, stamp);
+			}
+			if (timed) {
+				start = adapt_clock(CLOCK_MONOTONIC);
+				cpu = adapt_clock(CLOCK_THREAD_CPUTIME_ID);
+			}
+			result = task.func(task.arg);
+			if (timed) {
+				cpu = adapt_clock(CLOCK_THREAD_CPUTIME_ID) - cpu;
+				stamp = stamp ? start - stamp : 0;
+				run = adapt_clock(CLOCK_MONOTONIC) - start;
+			}
+			scratch_reset(&scratch);
+			if (task.flags & TASK_WANT_FUTURE) {
 				future_set(future, result);
 			}
-		} else {
-			goto exit;
+			if (rnode) {
+				resultq_put(rnode, result);
+			}
 		}
-	}
-
-	assert(0); /* should never reach here */
-	return NULL;
 
-exit:
-	{
-		int newnthreads;
-
-		pthread_mutex_lock(&tpool->tp_mutex);
-		newnthreads = --tpool->n_threads;
-		pthread_mutex_unlock(&tpool->tp_mutex);
-
-		if (newnthreads == 0) {
+		pthread_mutex_lock(&executor->ex_mutex);
+		if (errcode == 0 && timed && executor->ex_adaptive) {
+			executor_adapt(executor, stamp, run, cpu);
+		}
+		if (__atomic_sub_fetch(&tpool->n_threads, 1,
+						__ATOMIC_RELAXED) == 0
+				&& __atomic_load_n(&tpool->n_queued,
+						__ATOMIC_RELAXED) == 0) {
 			pthread_cond_broadcast(&tpool->tp_cond_empty);
 		}
+	}
 
-		pthread_exit(NULL);
+	if (executor->ex_threads == 0) {
+		pthread_cond_broadcast(&executor->ex_cond_empty);
 	}
+	pthread_mutex_unlock(&executor->ex_mutex);
+
+	scratch_bind(NULL);
+	scratch_destroy(&scratch);
+	pthread_exit(NULL);
 
 	assert(0); /* should never reach here */
 	return NULL;
@@ -198,19 +754,110 @@ exit:
  * in the queue will continue.  When the queue is empty, each of the threads in
  * the pool will exit.  If TPOOL_WAIT is set in flags, then, after disallowing
  * any new tasks, this function will block until all threads in the thread pool
- * exit. */
+ * exit.  Other pools sharing the same executor are not affected. */
 TPOOL_EXPORT void
 tpool_shutdown(TPOOL *tpool, int flags)
 {
-	pthread_mutex_lock(&tpool->tp_mutex);
+	TPOOL_EXECUTOR *executor = tpool->executor;
+
+	pthread_mutex_lock(&executor->ex_mutex);
 	tpool->alive = 0;
 	if (flags & TPOOL_WAIT) {
-		while (tpool->n_threads > 0 || tpool->queue.q_head) {
+		while (tpool->n_threads > 0 || __atomic_load_n(
+					&tpool->n_queued, __ATOMIC_RELAXED) > 0) {
 			pthread_cond_wait(&tpool->tp_cond_empty,
-							&tpool->tp_mutex);
+							&executor->ex_mutex);
+		}
+	}
+	pthread_mutex_unlock(&executor->ex_mutex);
+}
+
+/* Returns nonzero if the pool has not been shut down. */
+int
+pool_accepting(TPOOL *tpool)
+{
+	return __atomic_load_n(&tpool->alive, __ATOMIC_RELAXED);
+}
+
+/* Adds a task to the pool's queue and starts a worker for it if the pool and
+ * its executor have room for one.  The task is stamped with the time if the
+ * adaptive controller will want to know how long it waited.  Submitters only
+ * take ex_mutex when a worker has to be started, so that they do not share
+ * its line with the workers on every task. */
+static int
+pool_enqueue(TPOOL *tpool, struct tpool_task *task, size_t size,
+			void (*relocate)(void *, void *), FUTURE *future,
+			struct result_node *rnode)
+{
+	TPOOL_EXECUTOR *executor = tpool->executor;
+	uint64_t ticket;
+	uint64_t stamp = 0;
+	int errcode;
+	pthread_t threadid;
+
+	if (__atomic_load_n(&executor->ex_adaptive, __ATOMIC_RELAXED)) {
+		stamp = adapt_clock(CLOCK_MONOTONIC);
+		__atomic_add_fetch(&tpool->n_stamped, 1, __ATOMIC_RELAXED);
+		__atomic_add_fetch(&tpool->stamp_sum, stamp, __ATOMIC_RELAXED);
+	}
+	if ((errcode = task_queue_add(&tpool->queue, task, size, relocate,
+			future, rnode, stamp, &tpool->n_queued, &ticket)) != 0) {
+		if (stamp) {
+			pool_unstamp(tpool, stamp);
+		}
+		return errcode;
+	}
+
+	/* If every worker is stuck in a long task, none will finish one to
+	 * end the controller's interval, so the submitter that finds it over
+	 * does that instead. */
+	if (stamp && stamp >= __atomic_load_n(&executor->ex_due,
+							__ATOMIC_RELAXED)) {
+		pthread_mutex_lock(&executor->ex_mutex);
+		executor_decide(executor, stamp);
+		pthread_mutex_unlock(&executor->ex_mutex);
+	}
+
+	/* The add counted the task with a sequentially consistent increment
+	 * before these loads, which pairs with the decrement of ex_threads by
+	 * a worker about to exit in pool_worker(). */
+	if (__atomic_load_n(&executor->ex_threads, __ATOMIC_SEQ_CST)
+			>= __atomic_load_n(&executor->ex_target,
+							__ATOMIC_RELAXED)
+			|| __atomic_load_n(&tpool->n_threads, __ATOMIC_RELAXED)
+							>= tpool->pool_size) {
+		return 0;
+	}
+
+	/* If a worker cannot be started while others are running, the task
+	 * stays queued for one of them.  With no worker at all, nothing would
+	 * ever run it, so it is taken back out and the submit fails, unless a
+	 * worker that has since exited already ran it. */
+	pthread_mutex_lock(&executor->ex_mutex);
+	if (executor->ex_threads < executor->ex_target
+			&& tpool->n_threads < tpool->pool_size
+			&& __atomic_load_n(&tpool->n_queued, __ATOMIC_RELAXED)) {
+		if ((errcode = pthread_create(&threadid, NULL, &pool_worker,
+							executor)) == 0) {
+			__atomic_add_fetch(&executor->ex_threads, 1,
+							__ATOMIC_RELAXED);
+		} else if (executor->ex_threads == 0
+			&& task_queue_unlink(&tpool->queue, ticket) == 0) {
+			if (stamp) {
+				pool_unstamp(tpool, stamp);
+			}
+			if (__atomic_sub_fetch(&tpool->n_queued, 1,
+						__ATOMIC_RELAXED) == 0
+					&& tpool->n_threads == 0) {
+				pthread_cond_broadcast(&tpool->tp_cond_empty);
+			}
+		} else {
+			errcode = 0;
 		}
 	}
-	pthread_mutex_unlock(&tpool->tp_mutex);
+	pthread_mutex_unlock(&executor->ex_mutex);
+
+	return errcode;
 }
 
 /* This function adds a task to the thread pool, starting a thread for it if
@@ -224,16 +871,39 @@ tpool_shutdown(TPOOL *tpool, int flags)
  * tasks
  *   EINVAL: the passed-in task func is NULL
  *   ENOMEM: memory could not be allocated for the new task
+ *   EAGAIN: no worker thread was running and none could be started
  */
 TPOOL_EXPORT int
 tpool_submit(TPOOL *tpool, struct tpool_task *task, FUTURE **pfuture)
 {
+	return tpool_submit_inline(tpool, task, 0, NULL, pfuture);
+}
+
+/* Adds a task to the thread pool like tpool_submit(), but first moves the size
+ * bytes at task->arg into the queued task, so that the caller need not keep
+ * them alive or allocate them from the heap.  The task's function is called
+ * with a pointer to the moved copy, which is aligned to TPOOL_INLINE_ALIGN and
+ * only valid until it returns.  If
+ * relocate is NULL, the bytes are copied with memcpy(); otherwise the library
+ * calls relocate(dst, src) each time it moves the argument, and relocate must
+ * leave a working object at dst and none at src.  relocate may be called
+ * while a queue lock is held.  A size of 0 behaves exactly like
+ * tpool_submit().  Returns 0 on success, in which case the argument has been
+ * moved, or one of the error codes of tpool_submit(), in which case it has
+ * not.  EINVAL is also returned if size is greater than TPOOL_INLINE_SIZE. */
+TPOOL_EXPORT int
+tpool_submit_inline(TPOOL *tpool, struct tpool_task *task, size_t size,
+			void (*relocate)(void *dst, void *src),
+			FUTURE **pfuture)
+{
+	FUTURE *future = NULL;
 	int errcode;
-	pthread_t threadid;
 
 	if (task == NULL || task->func == NULL
 			|| ((task->flags & TASK_WANT_FUTURE)
-							&& pfuture == NULL)) {
+							&& pfuture == NULL)
+			|| size > TPOOL_INLINE_SIZE
+			|| (size && task->arg == NULL)) {
 		return EINVAL;
 	}
 
@@ -242,36 +912,57 @@ tpool_submit(TPOOL *tpool, struct tpool_task *task, FUTURE **pfuture)
 	}
 
 	if (task->flags & TASK_WANT_FUTURE) {
-		if ((*pfuture = calloc(1, sizeof(**pfuture))) == NULL) {
-			return errno;
-		}
-		if ((errcode = future_init(*pfuture)) != 0) {
-			free(*pfuture);
+		if ((future = cache_calloc(sizeof(*future))) == NULL) {
 			return errno;
 		}
-		if ((errcode = task_queue_add(&tpool->queue, task, *pfuture))
-									!= 0) {
-			return errcode;
-		}
-	} else {
-		if ((errcode = task_queue_add(&tpool->queue, task, NULL))
-									!= 0) {
+		if ((errcode = future_init(future)) != 0) {
+			free(future);
 			return errcode;
 		}
 	}
 
-	pthread_mutex_lock(&tpool->tp_mutex);
-	if (tpool->n_threads < tpool->pool_size) {
-		errcode = pthread_create(&threadid, NULL, &pool_worker, tpool);
-		if (errcode != 0 && tpool->n_threads == 0) {
-			return errcode;
-		} else {
-			++tpool->n_threads;
+	if ((errcode = pool_enqueue(tpool, task, size, relocate, future,
+							NULL)) != 0) {
+		if (future) {
+			future_set(future, NULL);
+			future_free(future);
 		}
+		return errcode;
+	}
+	if (future) {
+		*pfuture = future;
 	}
-	pthread_mutex_unlock(&tpool->tp_mutex);
-
 	return 0;
 }
 
+/* Adds a task to the thread pool like tpool_submit(), but instead of filling
+ * in a future, delivers the task's return value to the given result queue
+ * along with tag when the task finishes.  TASK_WANT_FUTURE may not be set in
+ * the task's flags.  Returns 0 on success or one of the error codes of
+ * tpool_submit(). */
+TPOOL_EXPORT int
+tpool_submit_resultq(TPOOL *tpool, struct tpool_task *task,
+					TPOOL_RESULTQ *resultq, void *tag)
+{
+	struct result_node *rnode;
+	int errcode;
+
+	if (task == NULL || task->func == NULL || resultq == NULL
+				|| (task->flags & TASK_WANT_FUTURE)) {
+		return EINVAL;
+	}
+
+	if (!tpool->alive) {
+		return ECANCELED;
+	}
+
+	if ((rnode = resultq_reserve(resultq, tag)) == NULL) {
+		return ENOMEM;
+	}
+	if ((errcode = pool_enqueue(tpool, task, 0, NULL, NULL, rnode)) != 0) {
+		resultq_cancel(rnode);
+	}
+	return errcode;
+}
+
 /* vim: set shiftwidth=8 tabstop=8 noexpandtab : */
@@ -0,0 +1,521 @@
+/* pipeline.c - multi-stage pipelines with backpressure for the tpool library
+ *
+ * Copyright (c) 2012 Patrick MacArthur
+ *
+ * This file is part of tpool.
+ *
+ * tpool is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * tpool is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public
+ * License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with tpool.  If not, see * <http://www.gnu.org/licenses/>.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <assert.h>
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "tpool.h"
+#include "tpool-private.h"
+
+/* A pipeline.  Items pushed into the pipeline are tagged in order and pass
+ * through each stage in turn before landing in p_output.  At most p_capacity
+ * items may be in the pipeline at once; each item holds one token from the
+ * time it is pushed until the time it is popped.  Since no channel can ever
+ * hold more items than there are tokens, a stage that has taken an item always
+ * has room to pass it on, and the reorder window of a serial stage can never
+ * exceed the size of its input channel. */
+struct tpool_pipeline {
+	TPOOL                   *p_tpool;
+	struct pipeline_stage   *p_first;
+	struct pipeline_stage   *p_last;
+	unsigned                p_capacity;
+	int                     p_started;
+	int                     p_closed;
+
+	/* set if a stage could not be run, after which the pipeline takes no
+	 * more items and tpool_pipeline_pop() returns the error */
+	int                     p_error;
+
+	/* Threads blocked in push or pop wait on p_cond.  Wakers only take
+	 * p_mutex if p_waiters is nonzero, so p_waiters is read on every push
+	 * and pop but rarely written, and stays with the read-mostly fields. */
+	unsigned                p_waiters;
+
+	/* taken by pushers and returned by poppers */
+	unsigned                p_tokens TPOOL_ALIGNED;
+	uint64_t                p_tag;
+
+	struct channel          p_output;
+
+	/* number of runner tasks that have been submitted but not finished */
+	unsigned                p_active TPOOL_ALIGNED;
+	pthread_mutex_t         p_mutex;
+	pthread_cond_t          p_cond;
+};
+
+/* Initializes a new pipeline which runs its stages in the given thread pool
+ * and stores it in *pipelinep.  At most capacity items may be in the pipeline
+ * at any time.  The flags argument is reserved and must be UINT32_C(0).
+ * Returns 0 on success; on error, it returns EINVAL if an argument is invalid
+ * or ENOMEM if memory could not be allocated. */
+TPOOL_EXPORT int
+tpool_pipeline_new(TPOOL *tpool, unsigned capacity, uint32_t flags,
+						TPOOL_PIPELINE **pipelinep)
+{
+	TPOOL_PIPELINE *pipeline;
+	int errcode;
+
+	if (!tpool || !capacity || flags || !pipelinep) {
+		errcode = EINVAL;
+		goto exit;
+	}
+
+	if ((pipeline = cache_calloc(sizeof(*pipeline))) == NULL) {
+		errcode = errno;
+		goto exit;
+	}
+	pipeline->p_tpool = tpool;
+	pipeline->p_capacity = capacity;
+	pipeline->p_tokens = capacity;
+	if ((errcode = channel_init(&pipeline->p_output, capacity, 0)) != 0) {
+		goto fail0;
+	}
+	if ((errcode = pthread_mutex_init(&pipeline->p_mutex, NULL)) != 0) {
+		goto fail1;
+	}
+	if ((errcode = pthread_cond_init(&pipeline->p_cond, NULL)) != 0) {
+		goto fail2;
+	}
+
+	errcode = 0;
+	*pipelinep = pipeline;
+	goto exit;
+fail2:
+	assert(errcode != 0);
+	pthread_mutex_destroy(&pipeline->p_mutex);
+fail1:
+	assert(errcode != 0);
+	channel_destroy(&pipeline->p_output);
+fail0:
+	assert(errcode != 0);
+	free(pipeline);
+exit:
+	return errcode;
+}
+
+/* Appends a stage to the pipeline.  Each item that reaches this stage is
+ * passed to func, and its return value is passed on to the next stage.  If
+ * TPOOL_STAGE_SERIAL is set in flags, the stage processes one item at a time
+ * in the order in which items were pushed into the pipeline; otherwise, up to
+ * parallelism items are processed at once, in no particular order.  A
+ * parallelism of 0 places no limit beyond the size of the thread pool.
+ * Stages may only be added before the first item is pushed.  Returns 0 on
+ * success; on error, it returns EINVAL if an argument is invalid, EBUSY if
+ * items have already been pushed, or ENOMEM. */
+TPOOL_EXPORT int
+tpool_pipeline_add_stage(TPOOL_PIPELINE *pipeline, void *(*func)(void *),
+						unsigned parallelism, int flags)
+{
+	struct pipeline_stage *stage;
+	int errcode;
+
+	if (!pipeline || !func || (flags & ~TPOOL_STAGE_SERIAL)) {
+		return EINVAL;
+	}
+	if (pipeline->p_started) {
+		return EBUSY;
+	}
+
+	if ((stage = cache_calloc(sizeof(*stage))) == NULL) {
+		return errno;
+	}
+	if ((errcode = channel_init(&stage->s_input, pipeline->p_capacity,
+					flags & TPOOL_STAGE_SERIAL)) != 0) {
+		free(stage);
+		return errcode;
+	}
+	stage->s_pipeline = pipeline;
+	stage->s_func = func;
+	stage->s_flags = flags;
+	if (flags & TPOOL_STAGE_SERIAL) {
+		stage->s_parallelism = 1;
+	} else {
+		stage->s_parallelism = parallelism ? parallelism : UINT_MAX;
+	}
+
+	if (pipeline->p_last) {
+		pipeline->p_last->s_next = stage;
+	} else {
+		pipeline->p_first = stage;
+	}
+	pipeline->p_last = stage;
+
+	return 0;
+}
+
+/* Wakes any thread blocked in tpool_pipeline_push() or tpool_pipeline_pop().
+ * The fence pairs with the one in pipeline_wait() so that either the waiter
+ * sees the change that was just made or we see the waiter. */
+static void
+pipeline_wake(TPOOL_PIPELINE *pipeline)
+{
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&pipeline->p_waiters, __ATOMIC_RELAXED)) {
+		pthread_mutex_lock(&pipeline->p_mutex);
+		pthread_cond_broadcast(&pipeline->p_cond);
+		pthread_mutex_unlock(&pipeline->p_mutex);
+	}
+}
+
+/* Blocks until ready(pipeline) returns nonzero. */
+static void
+pipeline_wait(TPOOL_PIPELINE *pipeline, int (*ready)(TPOOL_PIPELINE *))
+{
+	pthread_mutex_lock(&pipeline->p_mutex);
+	__atomic_add_fetch(&pipeline->p_waiters, 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	while (!ready(pipeline)) {
+		pthread_cond_wait(&pipeline->p_cond, &pipeline->p_mutex);
+	}
+	__atomic_sub_fetch(&pipeline->p_waiters, 1, __ATOMIC_RELAXED);
+	pthread_mutex_unlock(&pipeline->p_mutex);
+}
+
+/* Tries to claim a runner slot for the stage.  Returns nonzero on success. */
+static int
+stage_claim(struct pipeline_stage *stage)
+{
+	unsigned running;
+
+	running = __atomic_load_n(&stage->s_running, __ATOMIC_RELAXED);
+	do {
+		if (running >= stage->s_parallelism) {
+			return 0;
+		}
+	} while (!__atomic_compare_exchange_n(&stage->s_running, &running,
+					running + 1, 1, __ATOMIC_ACQ_REL,
+					__ATOMIC_RELAXED));
+	return 1;
+}
+
+static void *
+stage_run(void *arg);
+
+/* Makes sure that a runner will look at the stage's input, starting one in
+ * the thread pool if the stage is below its parallelism limit.  Returns 0 on
+ * success, or the error from tpool_submit() if a runner was needed and could
+ * not be started. */
+static int
+stage_kick(struct pipeline_stage *stage)
+{
+	TPOOL_PIPELINE *pipeline = stage->s_pipeline;
+	struct tpool_task task;
+	int errcode;
+
+	/* Pairs with the fence in stage_run(). */
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (!stage_claim(stage)) {
+		return 0;
+	}
+	pthread_mutex_lock(&pipeline->p_mutex);
+	++pipeline->p_active;
+	pthread_mutex_unlock(&pipeline->p_mutex);
+
+	task.func = &stage_run;
+	task.arg = stage;
+	task.flags = 0;
+	if ((errcode = tpool_submit(pipeline->p_tpool, &task, NULL)) != 0) {
+		__atomic_sub_fetch(&stage->s_running, 1, __ATOMIC_RELEASE);
+		pthread_mutex_lock(&pipeline->p_mutex);
+		--pipeline->p_active;
+		pthread_cond_broadcast(&pipeline->p_cond);
+		pthread_mutex_unlock(&pipeline->p_mutex);
+	}
+	return errcode;
+}
+
+/* Records that the pipeline cannot go on, and wakes anyone waiting on it so
+ * that they see the error.  The first error is kept. */
+static void
+pipeline_fail(TPOOL_PIPELINE *pipeline, int errcode)
+{
+	int expected = 0;
+
+	__atomic_compare_exchange_n(&pipeline->p_error, &expected, errcode, 0,
+					__ATOMIC_SEQ_CST, __ATOMIC_RELAXED);
+	pipeline_wake(pipeline);
+}
+
+/* Takes the next item for the stage from its input channel. */
+static int
+stage_take(struct pipeline_stage *stage, uint64_t *tagp, void **itemp)
+{
+	int errcode;
+
+	if (!(stage->s_flags & TPOOL_STAGE_SERIAL)) {
+		return channel_take(&stage->s_input, tagp, itemp);
+	}
+
+	*tagp = stage->s_tag;
+	if ((errcode = channel_take(&stage->s_input, tagp, itemp)) == 0) {
+		++stage->s_tag;
+	}
+	return errcode;
+}
+
+/* Passes an item on to the stage after the given one, or to the pipeline's
+ * output if this is the last stage.  Since the item holds a token, there is
+ * always room for it.  If the next stage cannot be run, the item is stuck
+ * there, so the pipeline is failed rather than leave poppers waiting. */
+static void
+stage_forward(struct pipeline_stage *stage, uint64_t tag, void *item)
+{
+	int errcode;
+
+	if (stage->s_next) {
+		errcode = channel_put(&stage->s_next->s_input, tag, item);
+		assert(errcode == 0);
+		if ((errcode = stage_kick(stage->s_next)) != 0) {
+			pipeline_fail(stage->s_pipeline, errcode);
+		}
+	} else {
+		errcode = channel_put(&stage->s_pipeline->p_output, tag, item);
+		assert(errcode == 0);
+		pipeline_wake(stage->s_pipeline);
+	}
+	(void)errcode;
+}
+
+/* This is the task that runs a stage in the thread pool.  It processes items
+ * until the stage's input is empty, releasing any scratch memory after each
+ * one.  After giving up its runner slot it checks the input once more, since
+ * an item that arrived in the meantime may have seen the stage at its
+ * parallelism limit and not started a runner. */
+static void *
+stage_run(void *arg)
+{
+	struct pipeline_stage *stage = (struct pipeline_stage *)arg;
+	TPOOL_PIPELINE *pipeline = stage->s_pipeline;
+	struct scratch *scratch = scratch_get();
+	uint64_t tag;
+	void *item;
+
+	do {
+		while (stage_take(stage, &tag, &item) == 0) {
+			item = stage->s_func(item);
+			if (scratch) {
+				scratch_reset(scratch);
+			}
+			stage_forward(stage, tag, item);
+		}
+		tag = stage->s_tag;
+		__atomic_sub_fetch(&stage->s_running, 1, __ATOMIC_RELEASE);
+		__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	} while (channel_ready(&stage->s_input, tag) && stage_claim(stage));
+
+	pthread_mutex_lock(&pipeline->p_mutex);
+	--pipeline->p_active;
+	pthread_cond_broadcast(&pipeline->p_cond);
+	pthread_mutex_unlock(&pipeline->p_mutex);
+	return NULL;
+}
+
+static int
+pipeline_can_push(TPOOL_PIPELINE *pipeline)
+{
+	return __atomic_load_n(&pipeline->p_tokens, __ATOMIC_RELAXED) > 0
+		|| __atomic_load_n(&pipeline->p_closed, __ATOMIC_RELAXED)
+		|| __atomic_load_n(&pipeline->p_error, __ATOMIC_RELAXED);
+}
+
+/* Pushes an item into the first stage of the pipeline.  If the pipeline is
+ * full and TPOOL_WAIT is set in flags, this function blocks until an item is
+ * popped from the other end; otherwise it returns EAGAIN.  Returns 0 on
+ * success, EINVAL if the pipeline has no stages, EPIPE if the pipeline has
+ * been closed, ECANCELED if its thread pool has been shut down, or another
+ * error if the first stage could not be run.  In the last case the pipeline
+ * has failed: later pushes return the same error, and so does
+ * tpool_pipeline_pop() once the items that made it through are popped. */
+TPOOL_EXPORT int
+tpool_pipeline_push(TPOOL_PIPELINE *pipeline, void *item, int flags)
+{
+	unsigned tokens;
+	uint64_t tag;
+	int errcode;
+
+	if (!pipeline || !pipeline->p_first) {
+		return EINVAL;
+	}
+	if (!pipeline->p_started) {
+		pipeline->p_started = 1;
+	}
+	if (!pool_accepting(pipeline->p_tpool)) {
+		return ECANCELED;
+	}
+
+	tokens = __atomic_load_n(&pipeline->p_tokens, __ATOMIC_RELAXED);
+	for (;;) {
+		if ((errcode = __atomic_load_n(&pipeline->p_error,
+						__ATOMIC_SEQ_CST)) != 0) {
+			return errcode;
+		}
+		if (tokens == 0) {
+			if (__atomic_load_n(&pipeline->p_closed,
+							__ATOMIC_SEQ_CST)) {
+				return EPIPE;
+			}
+			if (!(flags & TPOOL_WAIT)) {
+				return EAGAIN;
+			}
+			pipeline_wait(pipeline, &pipeline_can_push);
+			tokens = __atomic_load_n(&pipeline->p_tokens,
+							__ATOMIC_RELAXED);
+		} else if (__atomic_compare_exchange_n(&pipeline->p_tokens,
+					&tokens, tokens - 1, 1,
+					__ATOMIC_SEQ_CST, __ATOMIC_RELAXED)) {
+			break;
+		}
+	}
+
+	/* The token is taken before looking at p_closed, so that once
+	 * tpool_pipeline_pop() has seen the pipeline closed with every token
+	 * returned, no new item can slip in. */
+	if (__atomic_load_n(&pipeline->p_closed, __ATOMIC_SEQ_CST)) {
+		__atomic_add_fetch(&pipeline->p_tokens, 1, __ATOMIC_SEQ_CST);
+		pipeline_wake(pipeline);
+		return EPIPE;
+	}
+
+	tag = __atomic_fetch_add(&pipeline->p_tag, 1, __ATOMIC_RELAXED);
+	errcode = channel_put(&pipeline->p_first->s_input, tag, item);
+	assert(errcode == 0);
+
+	/* The item cannot be taken back out of the lock-free channel.  If no
+	 * runner can be started for it, its token is given back and the
+	 * pipeline is failed, so that nothing more is pushed over it. */
+	if ((errcode = stage_kick(pipeline->p_first)) != 0) {
+		pipeline_fail(pipeline, errcode);
+		__atomic_add_fetch(&pipeline->p_tokens, 1, __ATOMIC_SEQ_CST);
+		pipeline_wake(pipeline);
+	}
+	return errcode;
+}
+
+static int
+pipeline_drained(TPOOL_PIPELINE *pipeline)
+{
+	return __atomic_load_n(&pipeline->p_closed, __ATOMIC_SEQ_CST)
+		&& __atomic_load_n(&pipeline->p_tokens, __ATOMIC_SEQ_CST)
+						== pipeline->p_capacity;
+}
+
+static int
+pipeline_can_pop(TPOOL_PIPELINE *pipeline)
+{
+	return channel_ready(&pipeline->p_output, 0)
+		|| pipeline_drained(pipeline)
+		|| __atomic_load_n(&pipeline->p_error, __ATOMIC_SEQ_CST);
+}
+
+/* Pops an item that has passed through every stage of the pipeline and places
+ * it in *itemp.  Items come out in the order they were pushed if the last
+ * stage is serial.  If no item is ready and TPOOL_WAIT is set in flags, this
+ * function blocks until one is; otherwise it returns EAGAIN.  Returns 0 on
+ * success, EINVAL if an argument is invalid, or EPIPE once the pipeline has
+ * been closed and every item has been popped.  If a stage could not be run,
+ * the error that caused it is returned instead of waiting for items that will
+ * never arrive. */
+TPOOL_EXPORT int
+tpool_pipeline_pop(TPOOL_PIPELINE *pipeline, void **itemp, int flags)
+{
+	uint64_t tag;
+	int errcode;
+
+	if (!pipeline || !itemp) {
+		return EINVAL;
+	}
+
+	while (channel_take(&pipeline->p_output, &tag, itemp) != 0) {
+		if ((errcode = __atomic_load_n(&pipeline->p_error,
+						__ATOMIC_SEQ_CST)) != 0) {
+			return errcode;
+		}
+		if (pipeline_drained(pipeline)) {
+			return EPIPE;
+		}
+		if (!(flags & TPOOL_WAIT)) {
+			return EAGAIN;
+		}
+		pipeline_wait(pipeline, &pipeline_can_pop);
+	}
+
+	__atomic_add_fetch(&pipeline->p_tokens, 1, __ATOMIC_SEQ_CST);
+	pipeline_wake(pipeline);
+	return 0;
+}
+
+/* Marks the end of the pipeline's input.  Later pushes fail with EPIPE, and
+ * tpool_pipeline_pop() returns EPIPE once the items already pushed have all
+ * been popped. */
+TPOOL_EXPORT void
+tpool_pipeline_close(TPOOL_PIPELINE *pipeline)
+{
+	__atomic_store_n(&pipeline->p_closed, 1, __ATOMIC_SEQ_CST);
+	pipeline_wake(pipeline);
+}
+
+/* Destroys a pipeline.  Returns 0 on success, EINVAL if pipeline is NULL, or
+ * EBUSY if any item pushed into the pipeline has not yet been popped.  If
+ * EBUSY is returned, the pipeline is unchanged.  A pipeline that has failed
+ * may be freed with items still in it; they are dropped. */
+TPOOL_EXPORT int
+tpool_pipeline_free(TPOOL_PIPELINE *pipeline)
+{
+	struct pipeline_stage *stage;
+	struct pipeline_stage *next;
+
+	if (!pipeline) {
+		return EINVAL;
+	}
+	if (!__atomic_load_n(&pipeline->p_error, __ATOMIC_SEQ_CST)
+		&& __atomic_load_n(&pipeline->p_tokens, __ATOMIC_SEQ_CST)
+						!= pipeline->p_capacity) {
+		return EBUSY;
+	}
+
+	/* Runners may still be on their way out after forwarding their last
+	 * item. */
+	pthread_mutex_lock(&pipeline->p_mutex);
+	while (pipeline->p_active > 0) {
+		pthread_cond_wait(&pipeline->p_cond, &pipeline->p_mutex);
+	}
+	pthread_mutex_unlock(&pipeline->p_mutex);
+
+	for (stage = pipeline->p_first; stage; stage = next) {
+		next = stage->s_next;
+		channel_destroy(&stage->s_input);
+		free(stage);
+	}
+	channel_destroy(&pipeline->p_output);
+	pthread_mutex_destroy(&pipeline->p_mutex);
+	pthread_cond_destroy(&pipeline->p_cond);
+	free(pipeline);
+
+	return 0;
+}
+
+/* vim: set shiftwidth=8 tabstop=8 noexpandtab : */
@@ -30,49 +30,151 @@
 #include "tpool.h"
 #include "tpool-private.h"
 
+/* Initializes an empty queue.  The queue always holds a dummy node at its
+ * head, so that adding and removing never touch the same node's fields under
+ * different locks, except for the dummy's next pointer when the queue is
+ * empty. */
 int
 task_queue_init(struct task_queue *queue)
 {
+	struct task_node *dummy;
 	int errcode;
 
 	assert(queue != NULL);
 	memset(queue, 0, sizeof(*queue));
-	if ((errcode = pthread_mutex_init(&queue->q_mutex, NULL)) != 0) {
+	if (!(dummy = calloc(1, sizeof(*dummy)))) {
+		errcode = errno;
 		goto exit;
 	}
+	if ((errcode = pthread_mutex_init(&queue->q_head_mutex, NULL)) != 0) {
+		goto fail0;
+	}
+	if ((errcode = pthread_mutex_init(&queue->q_tail_mutex, NULL)) != 0) {
+		goto fail1;
+	}
+	queue->q_head = queue->q_tail = dummy;
 
 	errcode = 0;
+	goto exit;
+fail1:
+	pthread_mutex_destroy(&queue->q_head_mutex);
+fail0:
+	free(dummy);
 exit:
 	return errcode;
 }
 
+/* Frees a chain of unused nodes linked through their next pointers. */
+static void
+node_list_free(struct task_node *node)
+{
+	struct task_node *next;
+
+	for (; node != NULL; node = next) {
+		next = node->next;
+		free(node);
+	}
+}
+
 int
 task_queue_destroy(struct task_queue *queue)
 {
 	int errcode;
 
 	assert(queue != NULL);
-	if (queue->q_head) {
+	if (queue->q_head->next) {
 		errcode = EBUSY;
 		goto exit;
 	}
-	pthread_mutex_destroy(&queue->q_mutex);
+	free(queue->q_head);
+	node_list_free(queue->q_free);
+	node_list_free(queue->q_spare);
+	queue->q_head = queue->q_tail = NULL;
+	queue->q_free = queue->q_spare = NULL;
+	pthread_mutex_destroy(&queue->q_head_mutex);
+	pthread_mutex_destroy(&queue->q_tail_mutex);
 
 	errcode = 0;
 exit:
 	return errcode;
 }
 
-/* Adds a task to the tail of the queue.  This will return 0 if successful, and
- * an appropriate error code if it is not succesful.  The error codes defined
- * are EINVAL if an argument is invalid or ENOMEM if a new task could not be
- * allocated. */
+/* Moves an inline argument between buffers, using the submitter's relocate
+ * function if there is one. */
+static void
+payload_move(void *dst, void *src, size_t size,
+				void (*relocate)(void *, void *))
+{
+	if (relocate) {
+		relocate(dst, src);
+	} else {
+		memcpy(dst, src, size);
+	}
+}
+
+/* Hands a node that is no longer in the queue back for reuse.  Any thread may
+ * do this at any time; only task_queue_add() takes nodes off q_free, and it
+ * takes the whole list at once, so a node cannot reappear at the top while
+ * it is being taken. */
+static void
+node_release(struct task_queue *queue, struct task_node *node)
+{
+	struct task_node *top;
+
+	top = __atomic_load_n(&queue->q_free, __ATOMIC_RELAXED);
+	do {
+		node->next = top;
+	} while (!__atomic_compare_exchange_n(&queue->q_free, &top, node, 1,
+					__ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+/* Returns an unused node, or NULL and sets errno if there are none to reuse
+ * and a new one could not be allocated.  New nodes are allocated with the
+ * payload's alignment, which may be stricter than malloc() gives.  Must be
+ * called with q_tail_mutex held. */
+static struct task_node *
+node_get(struct task_queue *queue)
+{
+	struct task_node *node;
+	void *ptr;
+	int errcode;
+
+	if ((node = queue->q_spare) == NULL) {
+		node = __atomic_exchange_n(&queue->q_free, NULL,
+							__ATOMIC_ACQUIRE);
+		if (node == NULL) {
+			if ((errcode = posix_memalign(&ptr,
+					__alignof__(struct task_node),
+					sizeof(*node))) != 0) {
+				errno = errcode;
+				return NULL;
+			}
+			return ptr;
+		}
+	}
+	queue->q_spare = node->next;
+	return node;
+}
+
+/* Adds a task to the tail of the queue.  If size is nonzero, the size bytes at
+ * task->arg are moved into the queued task.  The stamp is kept with the task
+ * and handed back by task_queue_remove(), and the task's ticket is stored in
+ * *pticket for task_queue_unlink().  *counter is incremented under the tail
+ * lock once the node is published, so that the count of queued tasks always
+ * matches the nodes in queue order.  This will return 0 if successful,
+ * and an appropriate error code if it is not succesful.  The error codes
+ * defined are EINVAL if an argument is invalid or ENOMEM if a new task could
+ * not be allocated.  On failure, the argument has not been moved.  Only
+ * q_tail_mutex is taken, so adding does not contend with workers removing
+ * tasks, and once the queue has run a few tasks, adding reuses their nodes
+ * rather than allocating. */
 int
 task_queue_add(struct task_queue *queue, struct tpool_task *task,
-								FUTURE *future)
+			size_t size, void (*relocate)(void *, void *),
+			FUTURE *future, struct result_node *result,
+			uint64_t stamp, unsigned *counter, uint64_t *pticket)
 {
 	struct task_node *node;
-	struct tpool_task *copy;
 	int errcode, ret;
 
 	assert(task != NULL);
@@ -80,84 +182,134 @@ task_queue_add(struct task_queue *queue, struct tpool_task *task,
 		assert((task->flags & TASK_WANT_FUTURE) && future != NULL);
 	}
 
-	if (!(node = calloc(1, sizeof(*node)))) {
-		ret = errno;
+	if ((errcode = pthread_mutex_lock(&queue->q_tail_mutex)) != 0) {
+		fprintf(stderr, "Error locking task queue (add): %s\n",
+							strerror(errcode));
+		ret = errcode;
 		goto out;
 	}
-
-	/* We need to take a copy of the user's structure since it might have
-	 * been allocated from stack memory. */
-	assert(sizeof(*task) == sizeof(*copy));
-	if (!(copy = malloc(sizeof(*copy)))) {
+	if (!(node = node_get(queue))) {
 		ret = errno;
-		goto err1;
+		goto unlock;
 	}
-	memcpy(copy, task, sizeof(*copy));
 
-	/* Set up the node.  Fields have already been initialized to 0 at this
-	 * point. */
-	node->task = copy;
+	/* We need to take a copy of the user's structure since it might have
+	 * been allocated from stack memory. */
+	node->task = *task;
 	node->future = future;
-
-	if ((errcode = pthread_mutex_lock(&queue->q_mutex)) != 0) {
-		fprintf(stderr, "Error locking task queue (add): %s\n",
-							strerror(errcode));
-		ret = errcode;
-	} else {
-		/* Add the node to the tail of the queue structure */
-		if (queue->q_head == NULL) {
-			queue->q_head = queue->q_tail = node;
-		} else {
-			queue->q_tail->next = node;
-			queue->q_tail = node;
-		}
-		pthread_mutex_unlock(&queue->q_mutex);
-		ret = 0;
+	node->result = result;
+	node->next = NULL;
+	node->payload_size = size;
+	node->relocate = relocate;
+	node->stamp = stamp;
+	node->ticket = ++queue->q_tickets;
+	if (size) {
+		assert(size <= sizeof(node->payload));
+		payload_move(&node->payload, task->arg, size, relocate);
 	}
 
-	goto out;
-
-err1:
-	free(node);
+	/* Add the node to the tail of the queue structure.  This store
+	 * publishes the node to task_queue_remove(). */
+	__atomic_store_n(&queue->q_tail->next, node, __ATOMIC_RELEASE);
+	queue->q_tail = node;
+	__atomic_add_fetch(counter, 1, __ATOMIC_SEQ_CST);
+	*pticket = node->ticket;
+	ret = 0;
 
+unlock:
+	pthread_mutex_unlock(&queue->q_tail_mutex);
 out:
 	return ret;
 }
 
-/* Removes a task from the head of the queue.  Returns 0 on if there is no
- * error.  If there is a task in the queue, places the function in func and the
- * argument in taskarg; otherwise, sets func to NULL.  On error, prints a
- * message to stderr and returns an appropriate error code, leaving func and
- * taskarg undefined. */
+/* Takes back the task with the given ticket, which task_queue_add() queued
+ * but no worker will ever run, wherever it now is in the queue, and moves its
+ * inline argument back to task->arg as it was passed to task_queue_add().
+ * Must not be called while a task may be being removed.  Returns 0 on
+ * success, or ENOENT if the task has already been removed; its node may by
+ * then hold another task, which is why it is looked up by ticket.  Both locks
+ * are taken, head first. */
 int
-task_queue_remove(struct task_queue *queue, struct tpool_task **task,
-							FUTURE **pfuture)
+task_queue_unlink(struct task_queue *queue, uint64_t ticket)
 {
+	struct task_node *prev;
+	struct task_node *node;
+
+	pthread_mutex_lock(&queue->q_head_mutex);
+	pthread_mutex_lock(&queue->q_tail_mutex);
+	/* Tickets rise from head to tail, so the walk can stop at the first
+	 * one that is not lower. */
+	prev = queue->q_head;
+	while ((node = prev->next) != NULL && node->ticket < ticket) {
+		prev = node;
+	}
+	if (!node || node->ticket != ticket) {
+		pthread_mutex_unlock(&queue->q_tail_mutex);
+		pthread_mutex_unlock(&queue->q_head_mutex);
+		return ENOENT;
+	}
+	prev->next = node->next;
+	if (queue->q_tail == node) {
+		queue->q_tail = prev;
+	}
+	pthread_mutex_unlock(&queue->q_tail_mutex);
+	pthread_mutex_unlock(&queue->q_head_mutex);
+
+	if (node->payload_size) {
+		payload_move(node->task.arg, &node->payload,
+				node->payload_size, node->relocate);
+	}
+	node_release(queue, node);
+	return 0;
+}
+
+/* Removes a task from the head of the queue.  Returns 0 if there is a task in
+ * the queue, and places a copy of the task in *task, its future in *pfuture,
+ * its result node in *presult and the stamp it was added with in *pstamp.  If
+ * the task has an inline argument, it is moved into *payload and task->arg
+ * points there.  Returns EAGAIN if the queue is empty.  On error, prints a
+ * message to stderr and returns an appropriate error code, leaving the
+ * outputs undefined. */
+int
+task_queue_remove(struct task_queue *queue, struct tpool_task *task,
+			union task_payload *payload, FUTURE **pfuture,
+			struct result_node **presult, uint64_t *pstamp)
+{
+	struct task_node *dummy;
 	struct task_node *node;
 	int errcode;
-	assert(task != NULL && pfuture != NULL);
+	assert(task != NULL && pfuture != NULL && presult != NULL
+							&& pstamp != NULL);
 
-	if ((errcode = pthread_mutex_lock(&queue->q_mutex)) != 0) {
+	if ((errcode = pthread_mutex_lock(&queue->q_head_mutex)) != 0) {
 		fprintf(stderr, "Error locking task queue (remove): %s\n",
 							strerror(errcode));
 		return errcode;
-	} else {
-		if (queue->q_head == NULL) {
-			node = NULL;
-		} else {
-			node = queue->q_head;
-			queue->q_head = node->next;
-		}
-		pthread_mutex_unlock(&queue->q_mutex);
+	}
 
-		if (node != NULL) {
-			*task = node->task;
-			*pfuture = node->future;
-		} else {
-			*task = NULL;
-		}
-		return 0;
+	dummy = queue->q_head;
+	if ((node = __atomic_load_n(&dummy->next, __ATOMIC_ACQUIRE)) == NULL) {
+		pthread_mutex_unlock(&queue->q_head_mutex);
+		return EAGAIN;
 	}
+
+	/* The removed node becomes the new dummy, which the next remove will
+	 * free, so the inline argument has to be moved out before we let go
+	 * of the lock. */
+	*task = node->task;
+	*pfuture = node->future;
+	*presult = node->result;
+	*pstamp = node->stamp;
+	if (node->payload_size) {
+		payload_move(payload, &node->payload, node->payload_size,
+							node->relocate);
+		task->arg = payload;
+	}
+	queue->q_head = node;
+	pthread_mutex_unlock(&queue->q_head_mutex);
+
+	node_release(queue, dummy);
+	return 0;
 }
 
 /* vim: set shiftwidth=8 tabstop=8 noexpandtab : */
@@ -0,0 +1,252 @@
+/* resultq.c - delivers task results in the order the tasks finish
+ *
+ * Copyright (c) 2012 Patrick MacArthur
+ *
+ * This file is part of tpool.
+ *
+ * tpool is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * tpool is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public
+ * License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with tpool.  If not, see * <http://www.gnu.org/licenses/>.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <assert.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "tpool.h"
+#include "tpool-private.h"
+
+/* A queue of finished tasks' results.  Each task bound to the queue has a
+ * result_node allocated when it is submitted, which the worker appends to the
+ * queue when the task returns, so completing a task takes no allocation and a
+ * single lock. */
+struct tpool_resultq {
+	struct result_node      *rq_head;
+	struct result_node      *rq_tail;
+
+	/* number of bound tasks that have not yet finished */
+	unsigned                rq_pending;
+
+	pthread_mutex_t         rq_mutex;
+	pthread_cond_t          rq_cond;
+};
+
+/* Initializes a new, empty result queue and stores it in *resultqp.  The flags
+ * argument is reserved and must be UINT32_C(0).  Returns 0 on success; on
+ * error, it returns EINVAL if an argument is invalid or ENOMEM. */
+TPOOL_EXPORT int
+tpool_resultq_new(uint32_t flags, TPOOL_RESULTQ **resultqp)
+{
+	TPOOL_RESULTQ *resultq;
+	pthread_condattr_t attr;
+	int errcode;
+
+	if (!resultqp || flags) {
+		errcode = EINVAL;
+		goto exit;
+	}
+
+	if ((resultq = cache_calloc(sizeof(*resultq))) == NULL) {
+		errcode = errno;
+		goto exit;
+	}
+	if ((errcode = pthread_mutex_init(&resultq->rq_mutex, NULL)) != 0) {
+		goto fail0;
+	}
+	if ((errcode = pthread_condattr_init(&attr)) != 0) {
+		goto fail1;
+	}
+	if ((errcode = pthread_condattr_setclock(&attr, CLOCK_MONOTONIC))
+						!= 0
+		|| (errcode = pthread_cond_init(&resultq->rq_cond, &attr))
+						!= 0) {
+		pthread_condattr_destroy(&attr);
+		goto fail1;
+	}
+	pthread_condattr_destroy(&attr);
+
+	errcode = 0;
+	*resultqp = resultq;
+	goto exit;
+fail1:
+	assert(errcode != 0);
+	pthread_mutex_destroy(&resultq->rq_mutex);
+fail0:
+	assert(errcode != 0);
+	free(resultq);
+exit:
+	return errcode;
+}
+
+/* Destroys a result queue.  Returns 0 on success, EINVAL if resultq is NULL,
+ * or EBUSY if a task bound to the queue has not finished or a result has not
+ * been taken. */
+TPOOL_EXPORT int
+tpool_resultq_free(TPOOL_RESULTQ *resultq)
+{
+	int busy;
+
+	if (!resultq) {
+		return EINVAL;
+	}
+
+	pthread_mutex_lock(&resultq->rq_mutex);
+	busy = resultq->rq_pending || resultq->rq_head;
+	pthread_mutex_unlock(&resultq->rq_mutex);
+	if (busy) {
+		return EBUSY;
+	}
+
+	pthread_mutex_destroy(&resultq->rq_mutex);
+	pthread_cond_destroy(&resultq->rq_cond);
+	free(resultq);
+	return 0;
+}
+
+/* Allocates the node that will carry a task's result and counts the task as
+ * pending.  Returns NULL if memory could not be allocated. */
+struct result_node *
+resultq_reserve(TPOOL_RESULTQ *resultq, void *tag)
+{
+	struct result_node *node;
+
+	if ((node = malloc(sizeof(*node))) == NULL) {
+		return NULL;
+	}
+	node->r_queue = resultq;
+	node->r_next = NULL;
+	node->r_result.tag = tag;
+	node->r_result.value = NULL;
+
+	pthread_mutex_lock(&resultq->rq_mutex);
+	++resultq->rq_pending;
+	pthread_mutex_unlock(&resultq->rq_mutex);
+	return node;
+}
+
+/* Undoes resultq_reserve() for a task that could not be submitted. */
+void
+resultq_cancel(struct result_node *node)
+{
+	TPOOL_RESULTQ *resultq = node->r_queue;
+
+	pthread_mutex_lock(&resultq->rq_mutex);
+	--resultq->rq_pending;
+	pthread_cond_broadcast(&resultq->rq_cond);
+	pthread_mutex_unlock(&resultq->rq_mutex);
+	free(node);
+}
+
+/* Appends a finished task's result to its queue.  Should only be called from
+ * the worker threads. */
+void
+resultq_put(struct result_node *node, void *value)
+{
+	TPOOL_RESULTQ *resultq = node->r_queue;
+
+	node->r_result.value = value;
+	pthread_mutex_lock(&resultq->rq_mutex);
+	if (resultq->rq_tail) {
+		resultq->rq_tail->r_next = node;
+	} else {
+		resultq->rq_head = node;
+	}
+	resultq->rq_tail = node;
+	if (--resultq->rq_pending == 0) {
+		/* wake everyone who might now see ENOENT */
+		pthread_cond_broadcast(&resultq->rq_cond);
+	} else {
+		pthread_cond_signal(&resultq->rq_cond);
+	}
+	pthread_mutex_unlock(&resultq->rq_mutex);
+}
+
+/* Takes up to maxresults results from the queue, in the order their tasks
+ * finished, and stores them in results and their number in *countp.  If no
+ * result is ready, this function waits up to timeout milliseconds for one; a
+ * negative timeout waits indefinitely, and 0 does not wait at all.  All results
+ * that are ready are taken under a single lock.  Returns 0 on success, EINVAL
+ * if an argument is invalid, EAGAIN if the timeout expired, or ENOENT if the
+ * queue is empty and no bound task is still pending. */
+TPOOL_EXPORT int
+tpool_resultq_drain(TPOOL_RESULTQ *resultq, struct tpool_result *results,
+			unsigned maxresults, unsigned *countp, int timeout)
+{
+	struct result_node *node;
+	struct timespec deadline;
+	unsigned count;
+	int errcode;
+
+	if (!resultq || !results || !maxresults || !countp) {
+		return EINVAL;
+	}
+	*countp = 0;
+
+	if (timeout > 0) {
+		clock_gettime(CLOCK_MONOTONIC, &deadline);
+		deadline.tv_sec += timeout / 1000;
+		deadline.tv_nsec += (long)(timeout % 1000) * 1000000L;
+		if (deadline.tv_nsec >= 1000000000L) {
+			deadline.tv_nsec -= 1000000000L;
+			++deadline.tv_sec;
+		}
+	}
+
+	pthread_mutex_lock(&resultq->rq_mutex);
+	errcode = 0;
+	while (!resultq->rq_head && errcode == 0) {
+		if (!resultq->rq_pending) {
+			errcode = ENOENT;
+		} else if (timeout == 0) {
+			errcode = EAGAIN;
+		} else if (timeout < 0) {
+			pthread_cond_wait(&resultq->rq_cond,
+						&resultq->rq_mutex);
+		} else if (pthread_cond_timedwait(&resultq->rq_cond,
+				&resultq->rq_mutex, &deadline) == ETIMEDOUT
+					&& !resultq->rq_head) {
+			errcode = EAGAIN;
+		}
+	}
+
+	node = resultq->rq_head;
+	for (count = 0; node && count < maxresults; count++) {
+		results[count] = node->r_result;
+		resultq->rq_head = node->r_next;
+		free(node);
+		node = resultq->rq_head;
+	}
+	if (!resultq->rq_head) {
+		resultq->rq_tail = NULL;
+	}
+	pthread_mutex_unlock(&resultq->rq_mutex);
+
+	*countp = count;
+	return errcode;
+}
+
+/* Takes the next result from the queue and stores it in *result.  Waits as
+ * for tpool_resultq_drain() and returns the same error codes. */
+TPOOL_EXPORT int
+tpool_resultq_next(TPOOL_RESULTQ *resultq, struct tpool_result *result,
+								int timeout)
+{
+	unsigned count;
+
+	return tpool_resultq_drain(resultq, result, 1, &count, timeout);
+}
+
+/* vim: set shiftwidth=8 tabstop=8 noexpandtab : */
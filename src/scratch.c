@@ -0,0 +1,142 @@
+/* scratch.c - per-worker scratch memory for tasks in the tpool library
+ *
+ * Copyright (c) 2012 Patrick MacArthur
+ *
+ * This file is part of tpool.
+ *
+ * tpool is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * tpool is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public
+ * License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with tpool.  If not, see * <http://www.gnu.org/licenses/>.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <assert.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "tpool.h"
+#include "tpool-private.h"
+
+/* Every allocation is rounded up to a multiple of this, which is enough for
+ * any standard type. */
+#define SCRATCH_ALIGN 16
+
+#define SCRATCH_ROUND(size) \
+	(((size) + SCRATCH_ALIGN - 1) & ~(size_t)(SCRATCH_ALIGN - 1))
+
+/* A block allocated from the heap when the arena has no room left.  The
+ * header is padded so that the memory after it stays aligned. */
+struct scratch_block {
+	struct scratch_block *b_next;
+	char                 b_pad[SCRATCH_ALIGN - sizeof(void *)];
+};
+
+/* The arena of the worker running on this thread, if any. */
+static __thread struct scratch *scratch_current;
+
+/* Initializes an arena of the given size.  No memory is allocated until the
+ * first call to tpool_scratch_alloc(). */
+void
+scratch_init(struct scratch *scratch, size_t size)
+{
+	assert(scratch != NULL);
+	memset(scratch, 0, sizeof(*scratch));
+	scratch->sc_size = SCRATCH_ROUND(size);
+}
+
+/* Frees all memory handed out from the arena since the last reset. */
+void
+scratch_reset(struct scratch *scratch)
+{
+	struct scratch_block *block;
+
+	scratch->sc_used = 0;
+	while ((block = scratch->sc_overflow) != NULL) {
+		scratch->sc_overflow = block->b_next;
+		free(block);
+	}
+}
+
+void
+scratch_destroy(struct scratch *scratch)
+{
+	scratch_reset(scratch);
+	free(scratch->sc_base);
+	scratch->sc_base = NULL;
+}
+
+/* Makes the given arena the one used by tpool_scratch_alloc() on the calling
+ * thread. */
+void
+scratch_bind(struct scratch *scratch)
+{
+	scratch_current = scratch;
+}
+
+/* Returns the arena bound to the calling thread, or NULL. */
+struct scratch *
+scratch_get(void)
+{
+	return scratch_current;
+}
+
+/* Allocates size bytes of scratch memory for the task that is currently
+ * running.  The memory is aligned for any standard type and is released
+ * automatically when the task returns, or, in a pipeline, when the stage
+ * function returns.  It must not be freed and must not be used to return a
+ * value.  Memory comes from an arena owned by the worker
+ * thread, so no locks are taken; if the arena is full, the memory comes from
+ * the heap instead.  Returns NULL and sets errno to EPERM if not called from a
+ * task running in a thread pool, or to ENOMEM if memory could not be
+ * allocated. */
+TPOOL_EXPORT void *
+tpool_scratch_alloc(size_t size)
+{
+	struct scratch *scratch = scratch_current;
+	struct scratch_block *block;
+	void *ptr;
+
+	if (scratch == NULL) {
+		errno = EPERM;
+		return NULL;
+	}
+
+	if (size > SIZE_MAX - sizeof(*block) - SCRATCH_ALIGN) {
+		errno = ENOMEM;
+		return NULL;
+	}
+	size = SCRATCH_ROUND(size);
+	if (size <= scratch->sc_size - scratch->sc_used) {
+		if (scratch->sc_base == NULL) {
+			scratch->sc_base = malloc(scratch->sc_size);
+		}
+		if (scratch->sc_base != NULL) {
+			ptr = scratch->sc_base + scratch->sc_used;
+			scratch->sc_used += size;
+			return ptr;
+		}
+	}
+
+	if ((block = malloc(sizeof(*block) + size)) == NULL) {
+		errno = ENOMEM;
+		return NULL;
+	}
+	block->b_next = scratch->sc_overflow;
+	scratch->sc_overflow = block;
+	return block + 1;
+}
+
+/* vim: set shiftwidth=8 tabstop=8 noexpandtab : */
@@ -12,6 +12,8 @@
 #include <pthread.h>
 #include <errno.h>
 #include <string.h>
+#include <time.h>
+#include <unistd.h>
 
 #include "tpool.h"
 
@@ -59,9 +61,785 @@ submit_task(void *(*func)(void *), int flags)
 	}
 }
 
+/* Allocates scratch memory both inside and beyond the worker's 4 KiB arena
+ * and checks that each piece is aligned, that the pieces that fit were bumped
+ * off the arena one after another, and that the rest came from elsewhere.
+ * The address of the first piece is stored in *arg.  Returns the number of
+ * failures. */
+void *
+scratch_task(void *arg)
+{
+	struct timespec ts = { 0, 10000000L };
+	unsigned char *bufs[4];
+	size_t sizes[4] = { 1, 1000, 2000, 8192 };
+	uintptr_t failures = 0;
+	unsigned i;
+
+	for (i = 0; i < 4; i++) {
+		if ((bufs[i] = tpool_scratch_alloc(sizes[i])) == NULL
+				|| (uintptr_t)bufs[i] % 16 != 0) {
+			return (void *)(uintptr_t)1;
+		}
+		memset(bufs[i], i, sizes[i]);
+	}
+	for (i = 0; i < 4; i++) {
+		if (bufs[i][0] != i || bufs[i][sizes[i] - 1] != i) {
+			++failures;
+		}
+	}
+	if (bufs[1] != bufs[0] + 16 || bufs[2] != bufs[1] + 1008) {
+		++failures;
+	}
+	if (bufs[3] >= bufs[0] && bufs[3] < bufs[0] + 4096) {
+		++failures;
+	}
+	*(unsigned char **)arg = bufs[0];
+
+	/* keep the worker busy until the next task is queued behind us */
+	nanosleep(&ts, NULL);
+	return (void *)failures;
+}
+
+/* Runs scratch_task() twice on the single worker of a pool with a 4 KiB arena
+ * and checks that the arena was reset in between.  Returns the number of
+ * failures. */
+int
+test_scratch(void)
+{
+	unsigned char *first[2] = { NULL, NULL };
+	struct tpool_task task;
+	FUTURE *futures[2];
+	TPOOL *pool;
+	int failures = 0;
+	int errcode;
+	unsigned i;
+
+	if (tpool_scratch_alloc(16) != NULL || errno != EPERM) {
+		fprintf(stderr, "tpool_scratch_alloc worked outside a task\n");
+		return 1;
+	}
+
+	if ((errcode = tpool_new(1, UINT32_C(0), &pool)) != 0) {
+		fprintf(stderr, "tpool_new: %s\n", strerror(errcode));
+		return 1;
+	}
+	tpool_set_scratch_size(pool, 4096);
+	task.func = &scratch_task;
+	task.flags = TASK_WANT_FUTURE;
+	for (i = 0; i < 2; i++) {
+		task.arg = &first[i];
+		if ((errcode = tpool_submit(pool, &task, &futures[i])) != 0) {
+			fprintf(stderr, "submit task: %s\n",
+							strerror(errcode));
+			return 1;
+		}
+	}
+	for (i = 0; i < 2; i++) {
+		failures += (int)(uintptr_t)future_get(futures[i], TPOOL_WAIT);
+		future_free(futures[i]);
+	}
+	if (first[0] != first[1]) {
+		fprintf(stderr, "scratch: arena was not reset\n");
+		++failures;
+	}
+	tpool_shutdown(pool, TPOOL_WAIT);
+	tpool_free(pool);
+	if (failures) {
+		fprintf(stderr, "scratch task: %d failures\n", failures);
+	}
+	return failures;
+}
+
+/* Returns its argument after a delay that shrinks as the argument grows, so
+ * that later tasks tend to finish first. */
+void *
+delay_task(void *arg)
+{
+	struct timespec ts = { 0, (long)(20 - (uintptr_t)arg) * 100000L };
+
+	nanosleep(&ts, NULL);
+	return arg;
+}
+
+/* Binds tasks to a result queue and collects each result once, first one at
+ * a time and then in batches.  Returns the number of failures. */
+int
+test_resultq(void)
+{
+	TPOOL_RESULTQ *resultq;
+	struct tpool_task task;
+	struct tpool_result results[8];
+	bool seen[20] = { false };
+	unsigned count;
+	unsigned nseen = 0;
+	uintptr_t i;
+	int errcode;
+
+	if ((errcode = tpool_resultq_new(UINT32_C(0), &resultq)) != 0) {
+		fprintf(stderr, "tpool_resultq_new: %s\n", strerror(errcode));
+		return 1;
+	}
+	task.func = &delay_task;
+	task.flags = 0;
+	for (i = 0; i < 20; i++) {
+		task.arg = (void *)i;
+		if ((errcode = tpool_submit_resultq(tpool, &task, resultq,
+							(void *)i)) != 0) {
+			fprintf(stderr, "tpool_submit_resultq: %s\n",
+							strerror(errcode));
+			return 1;
+		}
+	}
+
+	for (;;) {
+		if (nseen < 5) {
+			errcode = tpool_resultq_next(resultq, results, -1);
+			count = 1;
+		} else {
+			errcode = tpool_resultq_drain(resultq, results, 8,
+								&count, 1000);
+		}
+		if (errcode == ENOENT) {
+			break;
+		} else if (errcode != 0) {
+			fprintf(stderr, "resultq: %s\n", strerror(errcode));
+			return 1;
+		}
+		for (i = 0; i < count; i++) {
+			uintptr_t tag = (uintptr_t)results[i].tag;
+
+			if (tag >= 20 || seen[tag]
+					|| results[i].value != results[i].tag) {
+				fprintf(stderr, "resultq: bad result %lu\n",
+							(unsigned long)tag);
+				return 1;
+			}
+			seen[tag] = true;
+			++nseen;
+		}
+	}
+
+	if (nseen != 20 || tpool_resultq_free(resultq) != 0) {
+		fprintf(stderr, "resultq: got %u results\n", nseen);
+		return 1;
+	}
+	printf("Result queue delivered %u results\n", nseen);
+	return 0;
+}
+
+/* State shared with the tasks of test_shared(). */
+pthread_mutex_t shared_mutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t shared_cond = PTHREAD_COND_INITIALIZER;
+bool shared_open = false;
+char shared_order[16];
+unsigned shared_count = 0;
+
+/* Holds the executor's only worker until test_shared() has queued every
+ * task. */
+void *
+gate_task(void *arg)
+{
+	(void)arg;
+	pthread_mutex_lock(&shared_mutex);
+	while (!shared_open) {
+		pthread_cond_wait(&shared_cond, &shared_mutex);
+	}
+	pthread_mutex_unlock(&shared_mutex);
+	return NULL;
+}
+
+/* Records which pool the task came from. */
+void *
+record_task(void *arg)
+{
+	pthread_mutex_lock(&shared_mutex);
+	shared_order[shared_count++] = *(char *)arg;
+	pthread_mutex_unlock(&shared_mutex);
+	return NULL;
+}
+
+/* Runs two pools with weights 3 and 1 on an executor with one worker and
+ * checks that the worker takes turns between them in that ratio.  Returns the
+ * number of failures. */
+int
+test_shared(void)
+{
+	static char names[2] = { 'A', 'B' };
+	TPOOL_EXECUTOR *executor;
+	TPOOL *pools[2];
+	TPOOL *extra;
+	struct tpool_task task;
+	unsigned i;
+	int errcode;
+
+	if ((errcode = tpool_executor_new(1, UINT32_C(0), &executor)) != 0) {
+		fprintf(stderr, "tpool_executor_new: %s\n", strerror(errcode));
+		return 1;
+	}
+	if (tpool_new_shared(executor, 3, 0, 0, UINT32_C(0), &pools[0]) != 0
+		|| tpool_new_shared(executor, 1, 0, 0, UINT32_C(0),
+							&pools[1]) != 0) {
+		fprintf(stderr, "tpool_new_shared failed\n");
+		return 1;
+	}
+	if (tpool_new_shared(executor, 1, 2, 0, UINT32_C(0), &extra) != EINVAL) {
+		fprintf(stderr, "tpool_new_shared allowed minthreads > size\n");
+		return 1;
+	}
+	if (tpool_get_size(pools[0]) != 1) {
+		fprintf(stderr, "tpool_get_size: expected 1, got %u\n",
+						tpool_get_size(pools[0]));
+		return 1;
+	}
+
+	task.func = &gate_task;
+	task.arg = NULL;
+	task.flags = 0;
+	tpool_submit(pools[0], &task, NULL);
+	task.func = &record_task;
+	for (i = 0; i < 8; i++) {
+		task.arg = &names[0];
+		tpool_submit(pools[0], &task, NULL);
+		task.arg = &names[1];
+		tpool_submit(pools[1], &task, NULL);
+	}
+	if (tpool_executor_free(executor) != EBUSY) {
+		fprintf(stderr, "tpool_executor_free: pools still attached\n");
+		return 1;
+	}
+
+	pthread_mutex_lock(&shared_mutex);
+	shared_open = true;
+	pthread_cond_broadcast(&shared_cond);
+	pthread_mutex_unlock(&shared_mutex);
+
+	tpool_shutdown(pools[1], TPOOL_WAIT);
+	tpool_shutdown(pools[0], TPOOL_WAIT);
+	if (tpool_free(pools[0]) != 0 || tpool_free(pools[1]) != 0
+			|| tpool_executor_free(executor) != 0) {
+		fprintf(stderr, "freeing shared pools failed\n");
+		return 1;
+	}
+
+	/* The gate task used the first of pool A's three turns. */
+	printf("Shared executor ran %.16s\n", shared_order);
+	if (memcmp(shared_order, "AABAAABAAABBBBBB", 16) != 0) {
+		fprintf(stderr, "shared executor: unexpected order\n");
+		return 1;
+	}
+	return 0;
+}
+
+int reserve_ran = 0;
+
+void *
+reserve_task(void *arg)
+{
+	__atomic_store_n(&reserve_ran, 1, __ATOMIC_RELAXED);
+	return arg;
+}
+
+/* Fills a two-worker executor with blocked tasks from one pool and checks
+ * that a second pool with a minimum of one still gets a worker.  Returns the
+ * number of failures. */
+int
+test_reserve(void)
+{
+	struct timespec ts = { 0, 1000000L };
+	TPOOL_EXECUTOR *executor;
+	TPOOL *greedy;
+	TPOOL *reserved;
+	TPOOL *extra;
+	struct tpool_task task;
+	unsigned i;
+	int ran;
+
+	if (tpool_executor_new(2, UINT32_C(0), &executor) != 0
+		|| tpool_new_shared(executor, 1, 0, 0, UINT32_C(0),
+							&greedy) != 0
+		|| tpool_new_shared(executor, 1, 1, 0, UINT32_C(0),
+							&reserved) != 0) {
+		fprintf(stderr, "reserve: setup failed\n");
+		return 1;
+	}
+	if (tpool_new_shared(executor, 1, 2, 0, UINT32_C(0), &extra)
+								!= EAGAIN) {
+		fprintf(stderr, "reserve: executor overcommitted\n");
+		return 1;
+	}
+
+	pthread_mutex_lock(&shared_mutex);
+	shared_open = false;
+	pthread_mutex_unlock(&shared_mutex);
+	task.func = &gate_task;
+	task.arg = NULL;
+	task.flags = 0;
+	for (i = 0; i < 3; i++) {
+		tpool_submit(greedy, &task, NULL);
+	}
+	/* give both workers the chance to start on the greedy pool */
+	for (i = 0; i < 50; i++) {
+		nanosleep(&ts, NULL);
+	}
+	task.func = &reserve_task;
+	tpool_submit(reserved, &task, NULL);
+	for (i = 0; i < 2000; i++) {
+		if ((ran = __atomic_load_n(&reserve_ran, __ATOMIC_RELAXED))) {
+			break;
+		}
+		nanosleep(&ts, NULL);
+	}
+
+	pthread_mutex_lock(&shared_mutex);
+	shared_open = true;
+	pthread_cond_broadcast(&shared_cond);
+	pthread_mutex_unlock(&shared_mutex);
+	tpool_shutdown(greedy, TPOOL_WAIT);
+	tpool_shutdown(reserved, TPOOL_WAIT);
+	if (tpool_free(greedy) != 0 || tpool_free(reserved) != 0
+			|| tpool_executor_free(executor) != 0) {
+		fprintf(stderr, "reserve: freeing pools failed\n");
+		return 1;
+	}
+	if (!ran) {
+		fprintf(stderr, "reserve: reserved worker was taken\n");
+		return 1;
+	}
+	return 0;
+}
+
+/* Checks that an executor whose pools' minimums would leave no worker for a
+ * pool without one refuses that pool, in either order, and that such a pool
+ * gets its tasks run once there is a worker to spare, also when the adaptive
+ * controller is on.  Returns the number of failures. */
+int
+test_reserve_full(void)
+{
+	struct tpool_adapt_stats stats;
+	TPOOL_EXECUTOR *executor;
+	TPOOL *owner;
+	TPOOL *other;
+	FUTURE *future;
+	struct tpool_task task;
+	int marker;
+
+	if (tpool_executor_new(1, UINT32_C(0), &executor) != 0
+		|| tpool_new_shared(executor, 1, 1, 0, UINT32_C(0),
+							&owner) != 0) {
+		fprintf(stderr, "reserve full: setup failed\n");
+		return 1;
+	}
+	if (tpool_new_shared(executor, 1, 0, 0, UINT32_C(0), &other)
+								!= EAGAIN) {
+		fprintf(stderr, "reserve full: pool without a minimum "
+						"accepted on a full executor\n");
+		return 1;
+	}
+	tpool_shutdown(owner, 0);
+	if (tpool_free(owner) != 0
+		|| tpool_new_shared(executor, 1, 0, 0, UINT32_C(0),
+							&other) != 0) {
+		fprintf(stderr, "reserve full: could not swap pools\n");
+		return 1;
+	}
+	if (tpool_new_shared(executor, 1, 1, 0, UINT32_C(0), &owner)
+								!= EAGAIN) {
+		fprintf(stderr, "reserve full: minimum accepted that would "
+					"leave a pool without workers\n");
+		return 1;
+	}
+	tpool_shutdown(other, 0);
+	if (tpool_free(other) != 0 || tpool_executor_free(executor) != 0) {
+		fprintf(stderr, "reserve full: teardown failed\n");
+		return 1;
+	}
+
+	/* With a worker to spare, the adaptive controller must not go below
+	 * the owner's minimum plus that worker. */
+	if (tpool_executor_new(2, UINT32_C(0), &executor) != 0
+		|| tpool_new_shared(executor, 1, 1, 0, UINT32_C(0),
+							&owner) != 0
+		|| tpool_new_shared(executor, 1, 0, 0, UINT32_C(0),
+							&other) != 0
+		|| tpool_set_adaptive(other, 1, 2, 10) != 0
+		|| tpool_get_adaptive(other, &stats) != 0) {
+		fprintf(stderr, "reserve full: setup failed\n");
+		return 1;
+	}
+	if (stats.target < 2) {
+		fprintf(stderr, "reserve full: adaptive target %u leaves no "
+					"worker to spare\n", stats.target);
+		return 1;
+	}
+	task.func = &reserve_task;
+	task.arg = &marker;
+	task.flags = TASK_WANT_FUTURE;
+	if (tpool_submit(other, &task, &future) != 0
+			|| future_get(future, TPOOL_WAIT) != &marker) {
+		fprintf(stderr, "reserve full: task did not run\n");
+		return 1;
+	}
+	future_free(future);
+	tpool_shutdown(other, TPOOL_WAIT);
+	tpool_shutdown(owner, TPOOL_WAIT);
+	if (tpool_free(other) != 0 || tpool_free(owner) != 0
+			|| tpool_executor_free(executor) != 0) {
+		fprintf(stderr, "reserve full: teardown failed\n");
+		return 1;
+	}
+	return 0;
+}
+
+unsigned adaptive_done = 0;
+
+/* Stands in for a task that spends its time waiting on I/O. */
+void *
+blocking_task(void *arg)
+{
+	struct timespec ts = { 0, 2000000L };
+
+	nanosleep(&ts, NULL);
+	__atomic_add_fetch(&adaptive_done, 1, __ATOMIC_RELAXED);
+	return arg;
+}
+
+/* Floods a pool with tasks that block and checks that the adaptive controller
+ * adds workers for them, beyond the one per processor it starts with.
+ * Returns the number of failures. */
+int
+test_adaptive(void)
+{
+	struct tpool_adapt_stats stats;
+	struct timespec ts = { 0, 5000000L };
+	struct tpool_task task;
+	TPOOL *pool;
+	unsigned size, ntasks, initial;
+	unsigned peak = 0;
+	bool grew = false;
+	unsigned i;
+	int errcode;
+
+	/* The controller starts at one worker per processor, so the pool
+	 * has to be larger than that for it to have room to grow. */
+	size = (unsigned)sysconf(_SC_NPROCESSORS_ONLN) + 4;
+	ntasks = 100 * size;
+	if ((errcode = tpool_new(size, UINT32_C(0), &pool)) != 0) {
+		fprintf(stderr, "tpool_new: %s\n", strerror(errcode));
+		return 1;
+	}
+	if (tpool_get_adaptive(pool, &stats) != ENOENT
+			|| tpool_set_adaptive(pool, 4, 2, 0) != EINVAL) {
+		fprintf(stderr, "adaptive: bad arguments accepted\n");
+		return 1;
+	}
+	if ((errcode = tpool_set_adaptive(pool, 1, size, 10)) != 0
+		|| (errcode = tpool_get_adaptive(pool, &stats)) != 0) {
+		fprintf(stderr, "tpool_set_adaptive: %s\n", strerror(errcode));
+		return 1;
+	}
+	initial = stats.target;
+
+	task.func = &blocking_task;
+	task.arg = NULL;
+	task.flags = 0;
+	for (i = 0; i < ntasks; i++) {
+		if ((errcode = tpool_submit(pool, &task, NULL)) != 0) {
+			fprintf(stderr, "tpool_submit: %s\n",
+							strerror(errcode));
+			return 1;
+		}
+	}
+	while (__atomic_load_n(&adaptive_done, __ATOMIC_RELAXED) < ntasks) {
+		tpool_get_adaptive(pool, &stats);
+		if (stats.target > peak) {
+			peak = stats.target;
+		}
+		if (stats.change > 0) {
+			grew = true;
+		}
+		nanosleep(&ts, NULL);
+	}
+	tpool_shutdown(pool, TPOOL_WAIT);
+
+	tpool_get_adaptive(pool, &stats);
+	printf("Adaptive pool grew from %u to %u workers in %lu decisions\n",
+			initial, peak, (unsigned long)stats.decisions);
+	if (!grew || peak <= initial || peak > size) {
+		fprintf(stderr, "adaptive: pool did not grow\n");
+		return 1;
+	}
+	if (tpool_set_adaptive(pool, 0, 0, 0) != 0
+			|| tpool_get_adaptive(pool, &stats) != ENOENT
+			|| tpool_free(pool) != 0) {
+		fprintf(stderr, "adaptive: could not turn off\n");
+		return 1;
+	}
+	return 0;
+}
+
+unsigned stalled_ran = 0;
+
+void *
+stalled_task(void *arg)
+{
+	__atomic_add_fetch(&stalled_ran, 1, __ATOMIC_RELAXED);
+	return arg;
+}
+
+/* Holds every worker the controller starts with in a task that does not
+ * finish, and checks that a task submitted after the interval is over still
+ * gets a worker started for the tasks waiting behind them.  Returns the
+ * number of failures. */
+int
+test_adaptive_stall(void)
+{
+	struct tpool_adapt_stats stats;
+	struct timespec ts = { 0, 1000000L };
+	struct tpool_task task;
+	TPOOL *pool;
+	unsigned size, initial;
+	unsigned ran = 0;
+	unsigned i;
+	int errcode;
+
+	size = (unsigned)sysconf(_SC_NPROCESSORS_ONLN) + 1;
+	if ((errcode = tpool_new(size, UINT32_C(0), &pool)) != 0
+		|| (errcode = tpool_set_adaptive(pool, 1, size, 10)) != 0
+		|| (errcode = tpool_get_adaptive(pool, &stats)) != 0) {
+		fprintf(stderr, "adaptive stall: %s\n", strerror(errcode));
+		return 1;
+	}
+	initial = stats.target;
+
+	pthread_mutex_lock(&shared_mutex);
+	shared_open = false;
+	pthread_mutex_unlock(&shared_mutex);
+	task.func = &gate_task;
+	task.arg = NULL;
+	task.flags = 0;
+	for (i = 0; i < initial; i++) {
+		tpool_submit(pool, &task, NULL);
+	}
+	task.func = &stalled_task;
+	tpool_submit(pool, &task, NULL);
+	for (i = 0; i < 30; i++) {
+		nanosleep(&ts, NULL);
+	}
+	tpool_submit(pool, &task, NULL);
+	for (i = 0; i < 2000; i++) {
+		if ((ran = __atomic_load_n(&stalled_ran,
+						__ATOMIC_RELAXED)) == 2) {
+			break;
+		}
+		nanosleep(&ts, NULL);
+	}
+
+	pthread_mutex_lock(&shared_mutex);
+	shared_open = true;
+	pthread_cond_broadcast(&shared_cond);
+	pthread_mutex_unlock(&shared_mutex);
+	tpool_shutdown(pool, TPOOL_WAIT);
+	if (tpool_free(pool) != 0) {
+		fprintf(stderr, "adaptive stall: freeing pool failed\n");
+		return 1;
+	}
+	if (ran != 2) {
+		fprintf(stderr, "adaptive stall: queued tasks were stranded\n");
+		return 1;
+	}
+	return 0;
+}
+
+/* Stage functions for test_pipeline().  Items are small integers stored
+ * directly in the pointer. */
+void *
+double_item(void *item)
+{
+	return (void *)(2 * (uintptr_t)item);
+}
+
+unsigned order_errors = 0;
+
+void *
+check_order(void *item)
+{
+	static uintptr_t expected = 0;
+
+	if ((uintptr_t)item != expected) {
+		++order_errors;
+	}
+	expected += 2;
+	return item;
+}
+
+int gated_entered = 0;
+
+/* Stage function that holds its runner until the shared gate opens. */
+void *
+gated_item(void *item)
+{
+	__atomic_store_n(&gated_entered, 1, __ATOMIC_RELAXED);
+	gate_task(NULL);
+	return item;
+}
+
+/* Checks that a pipeline on a pool that has been shut down refuses items
+ * instead of stranding them, both when the first stage cannot be started and
+ * when an item already inside cannot be passed to the next stage.  Returns
+ * the number of failures. */
+int
+test_pipeline_shutdown(void)
+{
+	struct timespec ts = { 0, 1000000L };
+	TPOOL_PIPELINE *pipeline;
+	TPOOL *pool;
+	void *item;
+	int errcode;
+
+	if (tpool_new(1, UINT32_C(0), &pool) != 0
+		|| tpool_pipeline_new(pool, 4, UINT32_C(0), &pipeline) != 0
+		|| tpool_pipeline_add_stage(pipeline, &double_item, 0, 0)
+									!= 0) {
+		fprintf(stderr, "pipeline shutdown: setup failed\n");
+		return 1;
+	}
+	tpool_shutdown(pool, TPOOL_WAIT);
+	if ((errcode = tpool_pipeline_push(pipeline, NULL, TPOOL_WAIT))
+							!= ECANCELED) {
+		fprintf(stderr, "pipeline shutdown: push returned %s\n",
+							strerror(errcode));
+		return 1;
+	}
+	if ((errcode = tpool_pipeline_pop(pipeline, &item, 0)) != EAGAIN
+			|| tpool_pipeline_free(pipeline) != 0
+			|| tpool_free(pool) != 0) {
+		fprintf(stderr, "pipeline shutdown: cleanup failed\n");
+		return 1;
+	}
+
+	/* Hold an item in the first of two stages while the pool is shut
+	 * down, so that passing it on to the second stage fails. */
+	pthread_mutex_lock(&shared_mutex);
+	shared_open = false;
+	pthread_mutex_unlock(&shared_mutex);
+	if (tpool_new(1, UINT32_C(0), &pool) != 0
+		|| tpool_pipeline_new(pool, 4, UINT32_C(0), &pipeline) != 0
+		|| tpool_pipeline_add_stage(pipeline, &gated_item, 0, 0) != 0
+		|| tpool_pipeline_add_stage(pipeline, &double_item, 0, 0) != 0
+		|| tpool_pipeline_push(pipeline, (void *)1, TPOOL_WAIT) != 0) {
+		fprintf(stderr, "pipeline shutdown: setup failed\n");
+		return 1;
+	}
+	while (!__atomic_load_n(&gated_entered, __ATOMIC_RELAXED)) {
+		nanosleep(&ts, NULL);
+	}
+	tpool_shutdown(pool, 0);
+	pthread_mutex_lock(&shared_mutex);
+	shared_open = true;
+	pthread_cond_broadcast(&shared_cond);
+	pthread_mutex_unlock(&shared_mutex);
+
+	if ((errcode = tpool_pipeline_pop(pipeline, &item, TPOOL_WAIT))
+							!= ECANCELED) {
+		fprintf(stderr, "pipeline shutdown: pop returned %s\n",
+							strerror(errcode));
+		return 1;
+	}
+	if ((errcode = tpool_pipeline_push(pipeline, NULL, 0)) != ECANCELED) {
+		fprintf(stderr, "pipeline shutdown: push after failure "
+					"returned %s\n", strerror(errcode));
+		return 1;
+	}
+	if ((errcode = tpool_pipeline_free(pipeline)) != 0) {
+		fprintf(stderr, "pipeline shutdown: free with an item left "
+					"returned %s\n", strerror(errcode));
+		return 1;
+	}
+	tpool_shutdown(pool, TPOOL_WAIT);
+	if (tpool_free(pool) != 0) {
+		fprintf(stderr, "pipeline shutdown: freeing pool failed\n");
+		return 1;
+	}
+	return 0;
+}
+
+/* Pushes more items through a small pipeline than it has room for, so that
+ * the producer is held back, and checks that the serial stages see the items
+ * in order.  Returns the number of failures. */
+
+int
+test_pipeline(void)
+{
+	const uintptr_t nitems = 1000;
+	TPOOL_PIPELINE *pipeline;
+	uintptr_t pushed = 0;
+	uintptr_t popped = 0;
+	void *item;
+	int errcode;
+
+	if ((errcode = tpool_pipeline_new(tpool, 8, UINT32_C(0), &pipeline))
+									!= 0) {
+		fprintf(stderr, "tpool_pipeline_new: %s\n", strerror(errcode));
+		return 1;
+	}
+	if (tpool_pipeline_add_stage(pipeline, &double_item, 0, 0) != 0
+		|| tpool_pipeline_add_stage(pipeline, &check_order, 0,
+						TPOOL_STAGE_SERIAL) != 0) {
+		fprintf(stderr, "tpool_pipeline_add_stage failed\n");
+		return 1;
+	}
+
+	while (popped < nitems) {
+		while (pushed < nitems
+			&& (errcode = tpool_pipeline_push(pipeline,
+					(void *)pushed, 0)) == 0) {
+			++pushed;
+		}
+		if (pushed == nitems) {
+			tpool_pipeline_close(pipeline);
+		} else if (errcode != EAGAIN) {
+			fprintf(stderr, "tpool_pipeline_push: %s\n",
+							strerror(errcode));
+			return 1;
+		}
+		if (pushed - popped > 8) {
+			fprintf(stderr, "pipeline: %lu items in flight\n",
+					(unsigned long)(pushed - popped));
+			return 1;
+		}
+		if ((errcode = tpool_pipeline_pop(pipeline, &item,
+							TPOOL_WAIT)) != 0) {
+			fprintf(stderr, "tpool_pipeline_pop: %s\n",
+							strerror(errcode));
+			return 1;
+		}
+		if ((uintptr_t)item != 2 * popped) {
+			fprintf(stderr, "pipeline: popped %lu, expected %lu\n",
+					(unsigned long)(uintptr_t)item,
+					(unsigned long)(2 * popped));
+			return 1;
+		}
+		++popped;
+	}
+
+	if ((errcode = tpool_pipeline_pop(pipeline, &item, TPOOL_WAIT))
+								!= EPIPE) {
+		fprintf(stderr, "pipeline: expected EPIPE, got %s\n",
+							strerror(errcode));
+		return 1;
+	}
+	if ((errcode = tpool_pipeline_free(pipeline)) != 0) {
+		fprintf(stderr, "tpool_pipeline_free: %s\n", strerror(errcode));
+		return 1;
+	}
+	printf("Pipeline passed %lu items\n", (unsigned long)popped);
+	return order_errors + test_pipeline_shutdown();
+}
+
 int
 main()
 {
+	int failures = 0;
 	int errcode;
 	FUTURE *f1;
 	FUTURE *f2;
@@ -89,13 +867,20 @@ main()
 	printf("Task 2 finished; returned value %p\n", value);
 	fflush(stdout);
 	future_free(f2);
+	failures += test_pipeline();
+	failures += test_scratch();
+	failures += test_shared();
+	failures += test_reserve();
+	failures += test_reserve_full();
+	failures += test_resultq();
+	failures += test_adaptive();
+	failures += test_adaptive_stall();
 	tpool_shutdown(tpool, TPOOL_WAIT);
 	if (tpool_free(tpool) == 0) {
 		printf("Thread pool destroyed\n");
 	}
 
-	pthread_exit(NULL);
-	return 0; /* should never reach this */
+	return failures ? EXIT_FAILURE : EXIT_SUCCESS;
 }
 
 /* vim: set shiftwidth=8 tabstop=8 noexpandtab : */
@@ -0,0 +1,247 @@
+/* test-tpool-cxx.cpp
+ *
+ * Patrick MacArthur <pio3@wildcats.unh.edu>
+ */
+
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <memory>
+#include <new>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "tpool.hpp"
+
+/* Counts malloc() calls made by the current thread, so that the tests can
+ * check that submitting a small callable does not allocate.  This covers
+ * operator new, which allocates with malloc(), and the library's own
+ * allocations alike.  Where malloc() cannot be wrapped, including under the
+ * sanitizers, which wrap it themselves, the exact checks are left out. */
+static thread_local unsigned long allocations = 0;
+
+#if defined(__GLIBC__) && !defined(__SANITIZE_ADDRESS__) \
+	&& !defined(__SANITIZE_THREAD__)
+#define COUNT_MALLOC 1
+extern "C" void *__libc_malloc(std::size_t size);
+
+extern "C" void *
+malloc(std::size_t size) noexcept
+{
+	++allocations;
+	return __libc_malloc(size);
+}
+#endif
+
+static int failures = 0;
+
+#define CHECK(cond) do { \
+	if (!(cond)) { \
+		std::fprintf(stderr, "%s:%d: check failed: %s\n", \
+					__FILE__, __LINE__, #cond); \
+		++failures; \
+	} \
+} while (0)
+
+int
+main()
+{
+	std::atomic<int> counter(0);
+
+	{
+		tpool::pool pool(4);
+
+		std::unique_ptr<int> owned(new int(5));
+		pool.post([&counter] { ++counter; });
+		pool.post([&counter, p = std::move(owned)] { counter += *p; });
+
+		/* A callable whose move may throw is boxed on the heap, since
+		 * the library could not pass the exception on. */
+		struct throwing_move {
+			std::atomic<int> *counter;
+
+			throwing_move(std::atomic<int> *c) : counter(c)
+			{
+			}
+
+			throwing_move(throwing_move &&other) noexcept(false)
+				: counter(other.counter)
+			{
+			}
+
+			void
+			operator()()
+			{
+				++*counter;
+			}
+		};
+		static_assert(!tpool::detail::fits_inline<throwing_move>::value,
+				"a throwing move must not be stored inline");
+		pool.post(throwing_move(&counter));
+
+		/* A callable as aligned as the payload is stored inline and
+		 * runs where its alignment holds; a more aligned one is
+		 * boxed. */
+		struct alignas(TPOOL_INLINE_ALIGN) aligned_fn {
+			std::atomic<int> *counter;
+
+			void
+			operator()()
+			{
+				if (reinterpret_cast<std::uintptr_t>(this)
+						% TPOOL_INLINE_ALIGN == 0) {
+					++*counter;
+				}
+			}
+		};
+		struct alignas(2 * TPOOL_INLINE_ALIGN) overaligned_fn {
+			char c;
+
+			void
+			operator()()
+			{
+			}
+		};
+		static_assert(tpool::detail::fits_inline<aligned_fn>::value,
+				"a callable aligned like the payload fits");
+		static_assert(
+			!tpool::detail::fits_inline<overaligned_fn>::value,
+			"a callable aligned beyond the payload must be boxed");
+		pool.post(aligned_fn{ &counter });
+
+		/* A large capture is moved to the heap instead. */
+		char big[256] = "big";
+		pool.post([&counter, big] { counter += big[0] == 'b'; });
+
+		tpool::future<int> f1 = pool.submit([] { return 6 * 7; });
+		tpool::future<std::string> f2 = pool.submit([] {
+			return std::string("hello");
+		});
+		tpool::future<void> f3 = pool.submit([] {
+			throw std::runtime_error("oops");
+		});
+		CHECK(f1.get() == 42);
+		CHECK(f2.get() == "hello");
+		bool threw = false;
+		try {
+			f3.get();
+		} catch (const std::runtime_error &) {
+			threw = true;
+		}
+		CHECK(threw);
+
+		std::vector<int> squares(1000);
+		pool.parallel_for(0, 1000, [&squares](int i) {
+			squares[i] = i * i;
+		});
+		for (int i = 0; i < 1000; i++) {
+			CHECK(squares[i] == i * i);
+		}
+
+		/* parallel_for from inside a task of the same pool must not
+		 * deadlock even when every worker does it. */
+		std::vector<tpool::future<long> > sums;
+		for (int t = 0; t < 8; t++) {
+			sums.push_back(pool.submit([&pool] {
+				std::atomic<long> sum(0);
+				pool.parallel_for(0L, 100L, [&sum](long i) {
+					sum += i;
+				});
+				return sum.load();
+			}));
+		}
+		for (auto &sum : sums) {
+			CHECK(sum.get() == 4950);
+		}
+	}
+	CHECK(counter == 9);
+
+	/* A pool on a shared executor with no limit of its own may use every
+	 * worker, and parallel_for() spreads its chunks accordingly. */
+	{
+		TPOOL_EXECUTOR *executor;
+
+		CHECK(tpool_executor_new(3, UINT32_C(0), &executor) == 0);
+		{
+			tpool::pool shared(executor, 1, 0, 0);
+			tpool::pool capped(executor, 1, 0, 10);
+			std::atomic<long> sum(0);
+
+			CHECK(shared.size() == 3);
+			CHECK(capped.size() == 3);
+			shared.parallel_for(0L, 100L, [&sum](long i) {
+				sum += i;
+			});
+			CHECK(sum == 4950);
+		}
+		tpool_executor_free(executor);
+	}
+
+	{
+		tpool::pool pool(1);
+		std::atomic<int> gate(0);
+		unsigned long before;
+
+		std::atomic<int> warm(0);
+
+		/* Queue a few tasks behind one that holds the only worker, so
+		 * that once they have run the queue has their nodes to reuse.
+		 * Then hold the worker again, so that none is started while
+		 * allocations are counted. */
+		auto hold = [&gate](int until) {
+			while (gate != until) {
+				std::this_thread::yield();
+			}
+		};
+		pool.post([hold] { hold(1); });
+		for (int i = 0; i < 4; i++) {
+			pool.post([&warm] { ++warm; });
+		}
+		gate = 1;
+		while (warm != 4) {
+			std::this_thread::yield();
+		}
+		pool.post([&gate, hold] {
+			gate = 2;
+			hold(3);
+		});
+		while (gate != 2) {
+			std::this_thread::yield();
+		}
+
+		/* A small, trivially copyable capture goes straight into the
+		 * queued task. */
+		before = allocations;
+		pool.post([&counter] { ++counter; });
+		CHECK(allocations == before);
+
+		/* So does a small move-only one. */
+		before = allocations;
+		std::unique_ptr<int> owned(new int(5));
+#ifdef COUNT_MALLOC
+		CHECK(allocations == before + 1);
+#endif
+		before = allocations;
+		pool.post([&counter, p = std::move(owned)] { counter += *p; });
+		CHECK(allocations == before);
+
+		/* submit() allocates only the future's shared state. */
+		before = allocations;
+		tpool::future<int> f = pool.submit([] { return 1; });
+#ifdef COUNT_MALLOC
+		CHECK(allocations == before + 1);
+#endif
+
+		gate = 3;
+		CHECK(f.get() == 1);
+	}
+	CHECK(counter == 15);
+
+	std::printf("C++ interface: %d failures\n", failures);
+	return failures ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+/* vim: set shiftwidth=8 tabstop=8 noexpandtab : */
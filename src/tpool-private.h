@@ -8,12 +8,33 @@
 
 #define TPOOL_EXPORT __attribute__ ((visibility("default")))
 
+/* Data written by different threads is kept this far apart so that the
+ * threads do not fight over cache lines.  This is two 64-byte lines, since
+ * many processors fetch lines in adjacent pairs. */
+#define TPOOL_CACHELINE 128
+
+/* Building with -DTPOOL_UNPADDED packs the structures as they were before the
+ * padding was added, so that "perf c2c" can compare the two layouts. */
+#ifdef TPOOL_UNPADDED
+#define TPOOL_ALIGNED
+#else
+#define TPOOL_ALIGNED __attribute__ ((aligned(TPOOL_CACHELINE)))
+#endif
+
+void *
+cache_calloc(size_t size);
+
+int
+pool_accepting(TPOOL *tpool);
+
+/* Futures are cache-aligned so that workers finishing neighbouring futures
+ * do not share a line. */
 struct future {
-	int             f_ready;
-	void            *f_value;
 	pthread_mutex_t f_mutex;
 	pthread_cond_t  f_cond;
-};
+	int             f_ready;
+	void            *f_value;
+} TPOOL_ALIGNED;
 
 int
 future_init(FUTURE *future);
@@ -21,13 +42,48 @@ future_init(FUTURE *future);
 void
 future_set(FUTURE *future, void *value);
 
+/* Carries the result of a task bound to a result queue. */
+struct result_node {
+	TPOOL_RESULTQ           *r_queue;
+	struct result_node      *r_next;
+	struct tpool_result     r_result;
+};
+
+struct result_node *
+resultq_reserve(TPOOL_RESULTQ *resultq, void *tag);
+
+void
+resultq_cancel(struct result_node *node);
+
+void
+resultq_put(struct result_node *node, void *value);
+
+/* Storage for a task's inline argument.  It is aligned to TPOOL_INLINE_ALIGN,
+ * which is at least what any standard type needs, rather than to whatever its
+ * members happen to need on this ABI, since C++ callers rely on it. */
+union task_payload {
+	unsigned char   bytes[TPOOL_INLINE_SIZE];
+	long long       align_ll;
+	long double     align_ld;
+	void            *align_ptr;
+} __attribute__ ((aligned(TPOOL_INLINE_ALIGN)));
+
 /* Represents a FIFO queue of tasks for the thread pool.  Any thread may
  * add a task to the tail.  Worker threads will pull a task off of the
- * head when they become available. */
+ * head when they become available.  The head and tail have separate locks on
+ * separate cache lines, so submitters and workers do not contend.  Nodes are
+ * reused: removing a task pushes the old dummy onto q_free, and adding one
+ * takes a node from q_spare, refilling it from q_free all at once when it
+ * runs dry. */
 struct task_queue {
 	struct task_node  *q_head;
-	struct task_node  *q_tail;
-	pthread_mutex_t   q_mutex;
+	pthread_mutex_t   q_head_mutex;
+	struct task_node  *q_free;
+
+	struct task_node  *q_tail TPOOL_ALIGNED;
+	pthread_mutex_t   q_tail_mutex;
+	struct task_node  *q_spare;
+	uint64_t          q_tickets;
 };
 
 int
@@ -38,18 +94,157 @@ task_queue_destroy(struct task_queue *queue);
 
 int
 task_queue_add(struct task_queue *queue, struct tpool_task *task,
-								FUTURE *future);
+			size_t size, void (*relocate)(void *, void *),
+			FUTURE *future, struct result_node *result,
+			uint64_t stamp, unsigned *counter, uint64_t *pticket);
+
+int
+task_queue_unlink(struct task_queue *queue, uint64_t ticket);
 
 int
-task_queue_remove(struct task_queue *queue, struct tpool_task **task,
-							FUTURE **pfuture);
+task_queue_remove(struct task_queue *queue, struct tpool_task *task,
+			union task_payload *payload, FUTURE **pfuture,
+			struct result_node **presult, uint64_t *pstamp);
+
 
-/* Represents a unit of work in the thread pool. */
+/* Represents a unit of work in the thread pool.  If payload_size is nonzero,
+ * the task's argument lives in payload rather than wherever task.arg
+ * pointed when it was submitted. */
 struct task_node {
-	struct tpool_task *task;
+	struct tpool_task task;
 	FUTURE *future;
+	struct result_node *result;
 	struct task_node *next;
+	size_t payload_size;
+	void (*relocate)(void *dst, void *src);
+	/* when the task was queued, if the adaptive controller is on */
+	uint64_t stamp;
+	/* the queue's count of tasks added when this one was; nodes are
+	 * reused, so this rather than the node's address identifies it */
+	uint64_t ticket;
+	union task_payload payload;
+};
+
+/* One slot of a channel.  The sequence number tells producers and consumers
+ * whose turn it is to use the slot. */
+struct channel_cell {
+	size_t          c_seq;
+	uint64_t        c_tag;
+	void            *c_item;
+};
+
+/* Represents a bounded lock-free ring of tagged items connecting two stages
+ * of a pipeline.  A FIFO channel may have any number of producers and
+ * consumers; an ordered channel hands items to its single consumer in tag
+ * order. */
+struct channel {
+	struct channel_cell *ch_cells;
+	size_t          ch_mask;
+	int             ch_ordered;
+
+	/* producers' and consumers' positions, on separate lines */
+	size_t          ch_head TPOOL_ALIGNED;
+	size_t          ch_tail TPOOL_ALIGNED;
+};
+
+int
+channel_init(struct channel *channel, size_t capacity, int ordered);
+
+void
+channel_destroy(struct channel *channel);
+
+int
+channel_put(struct channel *channel, uint64_t tag, void *item);
+
+int
+channel_take(struct channel *channel, uint64_t *tagp, void **itemp);
+
+int
+channel_ready(struct channel *channel, uint64_t tag);
+
+/* One stage of a pipeline.  A stage is run by up to s_parallelism runner
+ * tasks in the thread pool at a time, each of which drains s_input. */
+struct pipeline_stage {
+	struct tpool_pipeline   *s_pipeline;
+	struct pipeline_stage   *s_next;
+	void                    *(*s_func)(void *);
+	unsigned                s_parallelism;
+	int                     s_flags;
+
+	/* claimed by whoever starts a runner, so kept apart from the rest */
+	unsigned                s_running TPOOL_ALIGNED;
+
+	/* for serial stages, the tag of the next item to process */
+	uint64_t                s_tag;
+	struct channel          s_input;
 };
 
+/* A bump-pointer arena owned by a worker thread.  Tasks allocate from it
+ * with tpool_scratch_alloc(), and the worker resets it after each task.
+ * Allocations that do not fit go to the heap and are freed on reset. */
+struct scratch {
+	char                    *sc_base;
+	size_t                  sc_size;
+	size_t                  sc_used;
+	struct scratch_block    *sc_overflow;
+};
+
+void
+scratch_init(struct scratch *scratch, size_t size);
+
+void
+scratch_reset(struct scratch *scratch);
+
+void
+scratch_destroy(struct scratch *scratch);
+
+void
+scratch_bind(struct scratch *scratch);
+
+struct scratch *
+scratch_get(void);
+
+/* The adaptive controller of an executor.  Workers add a sample for each
+ * task they finish, and the first worker or submitter to find the interval
+ * over makes the next decision.  It is protected by the executor's mutex. */
+struct adapt {
+	unsigned                a_min;
+	unsigned                a_max;
+	uint64_t                a_interval;
+
+	/* samples taken since a_start */
+	uint64_t                a_start;
+	uint64_t                a_completed;
+	uint64_t                a_wait;
+	uint64_t                a_run;
+	uint64_t                a_cpu;
+
+	/* the hill climber's state */
+	unsigned                a_target;
+	int                     a_step;
+	unsigned                a_holds;
+	uint64_t                a_throughput;
+
+	struct tpool_adapt_stats a_stats;
+};
+
+uint64_t
+adapt_clock(clockid_t clock);
+
+void
+adapt_init(struct adapt *adapt, unsigned minthreads, unsigned maxthreads,
+			unsigned interval, unsigned floor, unsigned ncpus);
+
+void
+adapt_sample(struct adapt *adapt, uint64_t wait, uint64_t run, uint64_t cpu);
+
+int
+adapt_due(const struct adapt *adapt, uint64_t now);
+
+unsigned
+adapt_decide(struct adapt *adapt, uint64_t now, uint64_t queued_wait,
+			unsigned queued, unsigned threads, unsigned floor,
+			unsigned ncpus);
+
 #endif
 /* vim: set shiftwidth=8 tabstop=8 noexpandtab : */
@@ -21,6 +21,7 @@
 #ifndef TPOOL_H
 #define TPOOL_H
 
+#include <stddef.h>
 #include <stdint.h>
 #include <unistd.h>
 
@@ -29,9 +30,22 @@
 later version.
 #endif
 
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* The largest argument that tpool_submit_inline() can store in a queued
+ * task. */
+#define TPOOL_INLINE_SIZE 64
+
+/* The alignment of the copy that tpool_submit_inline() stores.  An argument
+ * that needs stricter alignment has to be passed by pointer instead. */
+#define TPOOL_INLINE_ALIGN 16
+
 enum tpool_flags {
 	TPOOL_WAIT = (1 << 0),
 	TASK_WANT_FUTURE = (1 << 8),
+	TPOOL_STAGE_SERIAL = (1 << 16),
 };
 
 /* Represents a unit of work in the thread pool. */
@@ -42,11 +56,70 @@ struct tpool_task {
 };
 
 
+/* Why the adaptive controller last changed, or kept, the number of workers
+ * an executor may run.  See tpool_set_adaptive(). */
+enum tpool_adapt_reason {
+	/* the target was left alone */
+	TPOOL_ADAPT_HOLD,
+	/* tasks did not wait and more than one worker's worth was idle */
+	TPOOL_ADAPT_IDLE,
+	/* tasks were waiting, so the controller tried another worker, or,
+	 * with the processors saturated, one fewer */
+	TPOOL_ADAPT_PROBE,
+	/* the last step raised throughput, so another was taken */
+	TPOOL_ADAPT_CLIMB,
+	/* the last step lowered throughput, so it was taken back */
+	TPOOL_ADAPT_REVERSE,
+	/* the last added worker did not raise throughput, so it was removed */
+	TPOOL_ADAPT_UNDO,
+};
+
+/* The adaptive controller's last decision and the measurements it was based
+ * on.  Loads are in percent of one thread, so 250 means two and a half
+ * threads' worth on average over the interval. */
+struct tpool_adapt_stats {
+	/* the number of workers the executor may now run */
+	unsigned target;
+	/* the number of workers running when the decision was made */
+	unsigned threads;
+	/* the change made to target: -1, 0 or 1 */
+	int change;
+	/* an enum tpool_adapt_reason */
+	int reason;
+	/* the number of decisions made since the controller was enabled */
+	uint64_t decisions;
+	/* tasks finished per second during the interval */
+	uint64_t throughput;
+	/* mean time a task spent queued, counting those still waiting, and
+	 * running, in nanoseconds */
+	uint64_t wait_ns;
+	uint64_t run_ns;
+	/* time spent running tasks, and processor time they used */
+	unsigned busy_load;
+	unsigned cpu_load;
+};
+
+/* The result of a finished task, as delivered by a result queue. */
+struct tpool_result {
+	void *tag;
+	void *value;
+};
+
 /* Represents a value that will be known at some point in the future. */
 typedef struct future FUTURE;
 
 /* Represents a thread pool. */
-typedef struct tpool TPOOL;
+typedef struct tpool_pool TPOOL;
+
+/* Represents a set of worker threads shared by several thread pools. */
+typedef struct tpool_executor TPOOL_EXECUTOR;
+
+/* Represents a queue of task results in the order the tasks finished. */
+typedef struct tpool_resultq TPOOL_RESULTQ;
+
+/* Represents a chain of stages run in a thread pool, connected by bounded
+ * channels. */
+typedef struct tpool_pipeline TPOOL_PIPELINE;
 
 int
 tpool_new(unsigned maxthreads, uint32_t flags, TPOOL **tpoolp);
@@ -54,17 +127,92 @@ tpool_new(unsigned maxthreads, uint32_t flags, TPOOL **tpoolp);
 int
 tpool_free(TPOOL *tpool);
 
+int
+tpool_executor_new(unsigned maxthreads, uint32_t flags,
+						TPOOL_EXECUTOR **executorp);
+
+int
+tpool_executor_free(TPOOL_EXECUTOR *executor);
+
+int
+tpool_new_shared(TPOOL_EXECUTOR *executor, unsigned weight,
+			unsigned minthreads, unsigned maxthreads,
+			uint32_t flags, TPOOL **tpoolp);
+
+unsigned
+tpool_get_size(TPOOL *tpool);
+
 void
 tpool_shutdown(TPOOL *tpool, int flags);
 
 int
 tpool_submit(TPOOL *tpool, struct tpool_task *task, FUTURE **pfuture);
 
+int
+tpool_submit_inline(TPOOL *tpool, struct tpool_task *task, size_t size,
+			void (*relocate)(void *dst, void *src),
+			FUTURE **pfuture);
+
+int
+tpool_submit_resultq(TPOOL *tpool, struct tpool_task *task,
+					TPOOL_RESULTQ *resultq, void *tag);
+
+int
+tpool_resultq_new(uint32_t flags, TPOOL_RESULTQ **resultqp);
+
+int
+tpool_resultq_free(TPOOL_RESULTQ *resultq);
+
+int
+tpool_resultq_next(TPOOL_RESULTQ *resultq, struct tpool_result *result,
+								int timeout);
+
+int
+tpool_resultq_drain(TPOOL_RESULTQ *resultq, struct tpool_result *results,
+			unsigned maxresults, unsigned *countp, int timeout);
+
+int
+tpool_set_scratch_size(TPOOL *tpool, size_t size);
+
+void *
+tpool_scratch_alloc(size_t size);
+
+int
+tpool_set_adaptive(TPOOL *tpool, unsigned minthreads, unsigned maxthreads,
+							unsigned interval);
+
+int
+tpool_get_adaptive(TPOOL *tpool, struct tpool_adapt_stats *stats);
+
 void *
 future_get(FUTURE *future, int flags);
 
 int
 future_free(FUTURE *future);
 
+int
+tpool_pipeline_new(TPOOL *tpool, unsigned capacity, uint32_t flags,
+						TPOOL_PIPELINE **pipelinep);
+
+int
+tpool_pipeline_add_stage(TPOOL_PIPELINE *pipeline, void *(*func)(void *),
+						unsigned parallelism, int flags);
+
+int
+tpool_pipeline_push(TPOOL_PIPELINE *pipeline, void *item, int flags);
+
+int
+tpool_pipeline_pop(TPOOL_PIPELINE *pipeline, void **itemp, int flags);
+
+void
+tpool_pipeline_close(TPOOL_PIPELINE *pipeline);
+
+int
+tpool_pipeline_free(TPOOL_PIPELINE *pipeline);
+
+#ifdef __cplusplus
+}
+#endif
+
 #endif
 /* vim: set shiftwidth=8 tabstop=8 noexpandtab : */
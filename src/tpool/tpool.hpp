@@ -0,0 +1,605 @@
+/* tpool.hpp - C++ interface to the tpool library
+ *
+ * Copyright (c) 2012 Patrick MacArthur
+ *
+ * This file is part of tpool.
+ *
+ * tpool is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * tpool is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with tpool.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef TPOOL_HPP
+#define TPOOL_HPP
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <exception>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <system_error>
+#include <type_traits>
+#include <utility>
+
+#include "tpool.h"
+
+namespace tpool {
+
+namespace detail {
+
+/* Tells the C library how to move a callable of type F between buffers.
+ * Trivially copyable callables are left to memcpy(); anything else is move
+ * constructed into place and the original destroyed. */
+template <typename F, bool Trivial = std::is_trivially_copyable<F>::value>
+struct relocator {
+	static void
+	relocate(void *dst, void *src) noexcept
+	{
+		F *from = static_cast<F *>(src);
+
+		::new (dst) F(std::move(*from));
+		from->~F();
+	}
+
+	static void (*get())(void *, void *)
+	{
+		return &relocate;
+	}
+};
+
+template <typename F>
+struct relocator<F, true> {
+	static void (*get())(void *, void *)
+	{
+		return nullptr;
+	}
+};
+
+/* Set if a callable of type F can be stored in a queued task.  It must fit
+ * the payload, whose alignment the library fixes at TPOOL_INLINE_ALIGN on
+ * every ABI.  The library moves it with relocate(), which has no way to
+ * report an exception, so its move constructor must not throw. */
+template <typename F>
+struct fits_inline : std::integral_constant<bool,
+		sizeof(F) <= TPOOL_INLINE_SIZE
+		&& alignof(F) <= TPOOL_INLINE_ALIGN
+		&& std::is_nothrow_move_constructible<F>::value> {
+};
+
+/* The C task function for a callable stored inline.  Exceptions cannot cross
+ * into the C library, so one escaping here ends the program, as it would for
+ * a std::thread. */
+template <typename F>
+void *
+invoke(void *arg) noexcept
+{
+	F *fn = static_cast<F *>(arg);
+
+	(*fn)();
+	fn->~F();
+	return nullptr;
+}
+
+/* Holds a callable too large to store inline. */
+template <typename F>
+struct boxed {
+	F *fn;
+
+	void
+	operator()()
+	{
+		std::unique_ptr<F> owner(fn);
+
+		(*owner)();
+	}
+};
+
+/* Holds the value a task produced until its future takes it. */
+template <typename T>
+struct future_value {
+	typename std::aligned_storage<sizeof(T), alignof(T)>::type storage;
+	bool set = false;
+
+	~future_value()
+	{
+		if (set) {
+			ptr()->~T();
+		}
+	}
+
+	T *
+	ptr()
+	{
+		return static_cast<T *>(static_cast<void *>(&storage));
+	}
+
+	template <typename F>
+	void
+	run(F &fn)
+	{
+		::new (static_cast<void *>(&storage)) T(fn());
+		set = true;
+	}
+
+	T
+	take()
+	{
+		return std::move(*ptr());
+	}
+};
+
+template <>
+struct future_value<void> {
+	template <typename F>
+	void
+	run(F &fn)
+	{
+		fn();
+	}
+
+	void
+	take()
+	{
+	}
+};
+
+/* The state shared by a task submitted with pool::submit() and its future.
+ * It has to outlive whichever of the two is done with it last, and the future
+ * may be moved around meanwhile, so it cannot live in either one; it is the
+ * single allocation that submit() makes.  Both hold a reference. */
+template <typename T>
+struct future_state : future_value<T> {
+	std::atomic<unsigned> refs;
+	std::mutex mutex;
+	std::condition_variable cond;
+	bool ready;
+	std::exception_ptr error;
+
+	future_state() : refs(2), ready(false)
+	{
+	}
+
+	void
+	release()
+	{
+		if (refs.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+			delete this;
+		}
+	}
+
+	/* Stores the result of fn(), or the exception it threw, and wakes
+	 * the future. */
+	template <typename F>
+	void
+	run(F &fn)
+	{
+		try {
+			future_value<T>::run(fn);
+		} catch (...) {
+			error = std::current_exception();
+		}
+		finish();
+	}
+
+	void
+	finish()
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+
+		ready = true;
+		cond.notify_all();
+	}
+
+	void
+	wait()
+	{
+		std::unique_lock<std::mutex> lock(mutex);
+
+		cond.wait(lock, [this] { return ready; });
+	}
+};
+
+/* Runs a callable and stores its result in the state it shares with a
+ * future.  If the task is destroyed without having run, the future gets a
+ * broken_promise error, as it would from a std::promise. */
+template <typename F, typename R>
+struct promise_task {
+	F fn;
+	future_state<R> *state;
+
+	promise_task(F &&f, future_state<R> *s) : fn(std::move(f)), state(s)
+	{
+	}
+
+	promise_task(promise_task &&other)
+			noexcept(std::is_nothrow_move_constructible<F>::value)
+		: fn(std::move(other.fn)), state(other.state)
+	{
+		other.state = nullptr;
+	}
+
+	~promise_task()
+	{
+		if (state) {
+			state->error = std::make_exception_ptr(
+				std::future_error(
+					std::future_errc::broken_promise));
+			state->finish();
+			state->release();
+		}
+	}
+
+	void
+	operator()()
+	{
+		state->run(fn);
+		state->release();
+		state = nullptr;
+	}
+};
+
+} /* namespace detail */
+
+/* A value of type T that a task submitted with pool::submit() will produce.
+ * If the task threw an exception, get() rethrows it. */
+template <typename T>
+class future {
+public:
+	future() : state_(nullptr)
+	{
+	}
+
+	explicit future(detail::future_state<T> *state) : state_(state)
+	{
+	}
+
+	future(future &&other) noexcept : state_(other.state_)
+	{
+		other.state_ = nullptr;
+	}
+
+	future &
+	operator=(future &&other) noexcept
+	{
+		if (this != &other) {
+			if (state_) {
+				state_->release();
+			}
+			state_ = other.state_;
+			other.state_ = nullptr;
+		}
+		return *this;
+	}
+
+	future(const future &) = delete;
+	future &operator=(const future &) = delete;
+
+	~future()
+	{
+		if (state_) {
+			state_->release();
+		}
+	}
+
+	/* Blocks until the task has finished and returns its result.  The
+	 * future is no longer valid afterwards. */
+	T
+	get()
+	{
+		std::unique_ptr<detail::future_state<T>, releaser> state(state_);
+
+		state_ = nullptr;
+		state->wait();
+		if (state->error) {
+			std::rethrow_exception(state->error);
+		}
+		return state->take();
+	}
+
+	void
+	wait() const
+	{
+		state_->wait();
+	}
+
+	/* Returns true if the task has finished. */
+	bool
+	ready() const
+	{
+		std::lock_guard<std::mutex> lock(state_->mutex);
+
+		return state_->ready;
+	}
+
+	bool
+	valid() const
+	{
+		return state_ != nullptr;
+	}
+
+private:
+	struct releaser {
+		void
+		operator()(detail::future_state<T> *state) const
+		{
+			state->release();
+		}
+	};
+
+	detail::future_state<T> *state_;
+};
+
+/* A thread pool.  Callables of up to TPOOL_INLINE_SIZE bytes are stored in the
+ * queued task itself, and the library reuses the nodes of tasks that have
+ * run, so posting one does not allocate once the pool is warm; larger ones
+ * are moved to the heap.  The destructor waits
+ * for every submitted task to finish. */
+class pool {
+public:
+	explicit pool(unsigned maxthreads)
+	{
+		int errcode;
+
+		if ((errcode = tpool_new(maxthreads, UINT32_C(0), &tpool_))
+									!= 0) {
+			throw std::system_error(errcode,
+					std::generic_category(), "tpool_new");
+		}
+		size_ = tpool_get_size(tpool_);
+	}
+
+	/* Attaches a new pool to an executor shared with other pools; see
+	 * tpool_new_shared(). */
+	pool(TPOOL_EXECUTOR *executor, unsigned weight, unsigned minthreads,
+					unsigned maxthreads)
+	{
+		int errcode;
+
+		if ((errcode = tpool_new_shared(executor, weight, minthreads,
+				maxthreads, UINT32_C(0), &tpool_)) != 0) {
+			throw std::system_error(errcode,
+				std::generic_category(), "tpool_new_shared");
+		}
+		size_ = tpool_get_size(tpool_);
+	}
+
+	pool(const pool &) = delete;
+	pool &operator=(const pool &) = delete;
+
+	~pool()
+	{
+		tpool_shutdown(tpool_, TPOOL_WAIT);
+		tpool_free(tpool_);
+	}
+
+	/* Returns the most tasks the pool runs at once; see
+	 * tpool_get_size(). */
+	unsigned
+	size() const
+	{
+		return size_;
+	}
+
+	/* Returns the underlying C handle. */
+	TPOOL *
+	handle() const
+	{
+		return tpool_;
+	}
+
+	/* Stops accepting new tasks; see tpool_shutdown(). */
+	void
+	shutdown(bool wait = true)
+	{
+		tpool_shutdown(tpool_, wait ? TPOOL_WAIT : 0);
+	}
+
+	/* Runs f() in the pool and ignores its result.  If f() throws, the
+	 * program is terminated. */
+	template <typename F>
+	void
+	post(F &&f)
+	{
+		enqueue<typename std::decay<F>::type>(std::forward<F>(f));
+	}
+
+	/* Runs f() in the pool and returns a future for its result.  This
+	 * allocates the state the task shares with the future, and nothing
+	 * else if the callable fits inline. */
+	template <typename F>
+	future<typename std::decay<decltype(
+		std::declval<typename std::decay<F>::type &>()())>::type>
+	submit(F &&f)
+	{
+		typedef typename std::decay<F>::type fn_type;
+		typedef typename std::decay<decltype(
+				std::declval<fn_type &>()())>::type result_type;
+		typedef detail::promise_task<fn_type, result_type> task_type;
+
+		fn_type fn(std::forward<F>(f));
+		detail::future_state<result_type> *state =
+				new detail::future_state<result_type>();
+		future<result_type> result(state);
+
+		enqueue<task_type>(task_type(std::move(fn), state));
+		return result;
+	}
+
+	/* Calls f(i) for every i in [first, last), spreading the calls over
+	 * the pool in chunks, and returns once all of them have returned.  The
+	 * calling thread works through chunks as well, so this may safely be
+	 * called from a task running in the same pool.  If any call throws,
+	 * the first exception is rethrown here after the rest have finished. */
+	template <typename Index, typename F>
+	void
+	parallel_for(Index first, Index last, F &&f);
+
+private:
+	/* Moves a callable of type G into a queued task, boxing it first if
+	 * it is too large to store inline. */
+	template <typename G, typename Arg>
+	typename std::enable_if<detail::fits_inline<G>::value>::type
+	enqueue(Arg &&arg)
+	{
+		typename std::aligned_storage<sizeof(G), alignof(G)>::type buf;
+		struct tpool_task task;
+		G *fn;
+		int errcode;
+
+		/* On success the library takes over the object in buf, so it
+		 * is only destroyed here if the submit fails. */
+		fn = ::new (static_cast<void *>(&buf)) G(std::forward<Arg>(arg));
+		task.func = &detail::invoke<G>;
+		task.arg = fn;
+		task.flags = 0;
+		if ((errcode = tpool_submit_inline(tpool_, &task, sizeof(G),
+				detail::relocator<G>::get(), nullptr)) != 0) {
+			fn->~G();
+			throw std::system_error(errcode,
+				std::generic_category(), "tpool_submit_inline");
+		}
+	}
+
+	template <typename G, typename Arg>
+	typename std::enable_if<!detail::fits_inline<G>::value>::type
+	enqueue(Arg &&arg)
+	{
+		std::unique_ptr<G> fn(new G(std::forward<Arg>(arg)));
+
+		enqueue<detail::boxed<G> >(detail::boxed<G>{ fn.get() });
+		fn.release();
+	}
+
+	TPOOL *tpool_;
+	unsigned size_;
+};
+
+namespace detail {
+
+/* Shared by the caller of pool::parallel_for() and its helper tasks.  Chunks
+ * are claimed from next_chunk, so whoever gets there first does the work.  A
+ * helper that starts after every chunk is claimed touches nothing but this
+ * structure, which it keeps alive, so the caller need only wait for the
+ * chunks themselves. */
+template <typename Index, typename F>
+struct for_state {
+	F *fn;
+	Index first;
+	Index last;
+	Index chunk;
+	std::size_t nchunks;
+	std::atomic<std::size_t> next_chunk;
+	std::size_t done;
+	std::exception_ptr error;
+	std::mutex mutex;
+	std::condition_variable cond;
+
+	for_state(F *f, Index b, Index e, Index c, std::size_t n)
+		: fn(f), first(b), last(e), chunk(c), nchunks(n),
+		  next_chunk(0), done(0)
+	{
+	}
+
+	/* Runs chunks until none are left. */
+	void
+	work()
+	{
+		std::size_t i;
+
+		while ((i = next_chunk.fetch_add(1)) < nchunks) {
+			Index begin = first + static_cast<Index>(i) * chunk;
+			Index end = (last - begin > chunk) ? begin + chunk
+								: last;
+			std::exception_ptr caught;
+
+			try {
+				for (Index j = begin; j != end; ++j) {
+					(*fn)(j);
+				}
+			} catch (...) {
+				caught = std::current_exception();
+			}
+
+			std::lock_guard<std::mutex> lock(mutex);
+			if (caught && !error) {
+				error = caught;
+			}
+			if (++done == nchunks) {
+				cond.notify_all();
+			}
+		}
+	}
+};
+
+template <typename Index, typename F>
+struct for_helper {
+	std::shared_ptr<for_state<Index, F> > state;
+
+	void
+	operator()()
+	{
+		state->work();
+	}
+};
+
+} /* namespace detail */
+
+template <typename Index, typename F>
+void
+pool::parallel_for(Index first, Index last, F &&f)
+{
+	typedef typename std::remove_reference<F>::type fn_type;
+	typedef detail::for_state<Index, fn_type> state_type;
+	std::size_t nworkers = size_;
+	std::size_t nchunks;
+	Index count;
+	Index chunk;
+
+	if (!(first < last)) {
+		return;
+	}
+
+	/* A few chunks per worker evens out chunks of uneven cost. */
+	count = last - first;
+	chunk = count / static_cast<Index>(4 * nworkers);
+	if (chunk < 1) {
+		chunk = 1;
+	}
+	nchunks = static_cast<std::size_t>((count + chunk - 1) / chunk);
+
+	std::shared_ptr<state_type> state = std::make_shared<state_type>(
+					&f, first, last, chunk, nchunks);
+	try {
+		for (std::size_t i = 1; i < nworkers && i < nchunks; i++) {
+			post(detail::for_helper<Index, fn_type>{ state });
+		}
+	} catch (const std::system_error &) {
+		/* The chunks still get done, just by fewer threads. */
+	}
+	state->work();
+
+	std::unique_lock<std::mutex> lock(state->mutex);
+	state->cond.wait(lock, [&state] {
+		return state->done == state->nchunks;
+	});
+	if (state->error) {
+		std::rethrow_exception(state->error);
+	}
+}
+
+} /* namespace tpool */
+
+#endif
+/* vim: set shiftwidth=8 tabstop=8 noexpandtab : */